@@ -16,7 +16,11 @@
 #define RTAGS_SINGLE_THREAD
 #include "ClangIndexer.h"
 
+#include <sys/resource.h>
 #include <unistd.h>
+#include <chrono>
+#include <limits>
+#include <thread>
 #if CINDEX_VERSION >= CINDEX_VERSION_ENCODE(0, 25)
 #include <clang-c/Documentation.h>
 #endif
@@ -35,6 +39,23 @@
 #include "VisitFileResponseMessage.h"
 #include "Location.h"
 
+static inline uint64_t profileTime()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t peakMemory()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef OS_Darwin
+    return usage.ru_maxrss;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
 static inline void setType(Symbol &symbol, const CXType &type)
 {
     symbol.type = type.kind;
@@ -105,6 +126,8 @@ bool ClangIndexer::exec(const String &data)
         sState = Running;
     }
     mFromCache = false;
+    mReusedVisit = false;
+    mWrittenMaps.clear();
     mTimer.restart();
     mMacroTokens.clear();
     mUnits.clear();
@@ -123,6 +146,7 @@ bool ClangIndexer::exec(const String &data)
     mTemplateSpecializations.clear();
     mInTemplateFunction = false;
     mIndexDataMessage.clear();
+    mFileCache.clear();
     mTranslationUnits.clear();
     mUnsavedFiles.clear();
 
@@ -249,15 +273,26 @@ bool ClangIndexer::exec(const String &data)
     assert(mConnection->isConnected());
     assert(mSources.front().fileId);
     mIndexDataMessage.files()[mSources.front().fileId] |= IndexDataMessage::Visited;
+    IndexProfile &profile = mIndexDataMessage.profile();
+    profile.jobs = 1;
+    uint64_t start = profileTime();
     bool ok = parse();
+    profile.parse = profileTime() - start;
     if (ClangIndexer::state() == Stopped)
         return true;
-    if (ok)
-        ok = visit();
+    if (ok) {
+        start = profileTime();
+        mReusedVisit = reuseVisit();
+        if (!mReusedVisit)
+            ok = visit();
+        profile.visit = profileTime() - start;
+    }
     if (ClangIndexer::state() == Stopped)
         return true;
     if (ok)
         ok = diagnose();
+    if (ok)
+        hashFiles();
 
     String message = mSourceFile.toTilde();
     String err;
@@ -271,19 +306,29 @@ bool ClangIndexer::exec(const String &data)
             break;
         }
     }
+    start = profileTime();
     if (!hasUnit || !writeFiles(RTags::encodeSourceFilePath(mDataDir, mProject, mCompileCommandsFileId), err)) {
         message += " error";
         if (!err.empty())
             message += (' ' + err);
     } else {
         writeDuration = sw.elapsed();
+        profile.write = profileTime() - start;
+        if (mMode == Daemon)
+            cacheVisit();
     }
+    profile.visitFileQueries = mFileIdsQueried;
+    profile.cursors = mCursorsVisited;
+    profile.blockedCursors = mBlocked;
+    profile.bytesWritten = mIndexDataMessage.bytesWritten();
 
     if (ClangIndexer::state() == Stopped)
         return true;
     if (!mTrailer.empty()) {
         message += " (" + mTrailer + ')';
     }
+    if (mReusedVisit)
+        message += " (unchanged)";
     message += String::format<16>(" in %lldms. ", mTimer.elapsed());
     if (mSources.size() > 1) {
         message += String::format("(%zu builds) ", mSources.size());
@@ -336,6 +381,7 @@ bool ClangIndexer::exec(const String &data)
         message += ")";
 
     mIndexDataMessage.setMessage(std::move(message));
+    mIndexDataMessage.setPeakMemory(peakMemory());
     sw.restart();
     if (ClangIndexer::state() == Stopped)
         return true;
@@ -389,28 +435,8 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     assert(!resolved.contains("/../"));
 
     if (id) {
-        if (blockedPtr) {
-            Hash<uint32_t, Flags<IndexDataMessage::FileFlag>>::iterator it = mIndexDataMessage.files().find(id);
-            if (it == mIndexDataMessage.files().end()) {
-                // the only reason we already have an id for a file that isn't
-                // in the mIndexDataMessage.mFiles is that it's blocked from the outset.
-                // The assumption is that we never will go and fetch a file id
-                // for a location without passing blockedPtr since any reference
-                // to a symbol in another file should have been preceded by that
-                // header in which case we would have to make a decision on
-                // whether or not to index it. This is a little hairy but we
-                // have to try to optimize this process.
-#ifndef NDEBUG
-                if (resolved.empty())
-                    resolved = sourceFile.resolved();
-#endif
-                assert(id);
-                mIndexDataMessage.files()[id] = IndexDataMessage::NoFileFlag;
-                *blockedPtr = true;
-            } else if (!it->second) {
-                *blockedPtr = true;
-            }
-        }
+        if (blockedPtr && isBlocked(id))
+            *blockedPtr = true;
         return Location(id, line, col);
     }
 
@@ -421,7 +447,9 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     mVisitFileResponseMessageVisit = false;
     mConnection->send(msg);
     StopWatch sw;
+    const uint64_t waitStart = profileTime();
     EventLoop::eventLoop()->exec(mVisitFileTimeout);
+    mIndexDataMessage.profile().visitFileWait += profileTime() - waitStart;
     const int elapsed = sw.elapsed();
     mFileIdsQueriedTime += elapsed;
     switch (mVisitFileResponseMessageFileId) {
@@ -455,6 +483,60 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     return Location(id, line, col);
 }
 
+Location ClangIndexer::createLocation(CXFile file, unsigned int line, unsigned int col, bool *blockedPtr)
+{
+    if (blockedPtr)
+        *blockedPtr = false;
+    if (!file)
+        return Location();
+
+    CXFileUniqueID uniqueId;
+    if (clang_getFileUniqueID(file, &uniqueId))
+        return DiagnosticsProvider::createLocation(file, line, col, blockedPtr);
+    const FileUniqueId key = { { uniqueId.data[0], uniqueId.data[1], uniqueId.data[2] } };
+    auto it = mFileCache.find(key);
+    if (it == mFileCache.end()) {
+        const Location loc = DiagnosticsProvider::createLocation(file, line, col, blockedPtr);
+        FileCacheEntry entry = { loc.fileId(), FileCacheEntry::Unknown };
+        if (!entry.fileId) {
+            entry.state = FileCacheEntry::Allowed;
+        } else if (blockedPtr) {
+            entry.state = *blockedPtr ? FileCacheEntry::Blocked : FileCacheEntry::Allowed;
+        }
+        mFileCache[key] = entry;
+        return loc;
+    }
+
+    FileCacheEntry &entry = it->second;
+    if (!entry.fileId)
+        return Location();
+    if (blockedPtr) {
+        if (entry.state == FileCacheEntry::Unknown)
+            entry.state = isBlocked(entry.fileId) ? FileCacheEntry::Blocked : FileCacheEntry::Allowed;
+        *blockedPtr = entry.state == FileCacheEntry::Blocked;
+    }
+    return Location(entry.fileId, line, col);
+}
+
+bool ClangIndexer::isBlocked(uint32_t fileId)
+{
+    assert(fileId);
+    Hash<uint32_t, Flags<IndexDataMessage::FileFlag>>::iterator it = mIndexDataMessage.files().find(fileId);
+    if (it == mIndexDataMessage.files().end()) {
+        // the only reason we already have an id for a file that isn't
+        // in the mIndexDataMessage.mFiles is that it's blocked from the outset.
+        // The assumption is that we never will go and fetch a file id
+        // for a location without passing blockedPtr since any reference
+        // to a symbol in another file should have been preceded by that
+        // header in which case we would have to make a decision on
+        // whether or not to index it. This is a little hairy but we
+        // have to try to optimize this process.
+        mIndexDataMessage.files()[fileId] = IndexDataMessage::NoFileFlag;
+        return true;
+    }
+    return !it->second;
+}
+
 CXTranslationUnit ClangIndexer::unit(size_t u) const
 {
     return mTranslationUnits[u]->unit;
@@ -753,12 +835,90 @@ CXChildVisitResult ClangIndexer::visitorHelper(CXCursor cursor, CXCursor, CXClie
     if (ClangIndexer::state() == Stopped)
         return CXChildVisit_Break;
     ClangIndexer *indexer = static_cast<ClangIndexer*>(data);
-    const CXChildVisitResult res = indexer->indexVisitor(cursor);
+    CXChildVisitResult res;
+    if (ClangIndexer::serverOpts() & Server::IndexerProfile) {
+        IndexProfile &profile = indexer->mIndexDataMessage.profile();
+        const uint64_t wait = profile.visitFileWait;
+        const uint64_t start = profileTime();
+        res = indexer->indexVisitor(cursor);
+        IndexProfile::Kind &kind = profile.kinds[clang_getCursorKind(cursor)];
+        ++kind.count;
+        kind.time += (profileTime() - start) - (profile.visitFileWait - wait);
+    } else {
+        res = indexer->indexVisitor(cursor);
+    }
     if (res == CXChildVisit_Recurse)
         indexer->visit(cursor);
     return CXChildVisit_Continue;
 }
 
+CXChildVisitResult ClangIndexer::topLevelVisitor(CXCursor cursor, CXCursor parent, CXClientData data)
+{
+    // Declarations from headers that another job has already indexed (or
+    // that we lost the visitFile race for) are skipped wholesale here
+    // without going through the Path based createLocation for every
+    // top-level cursor. Headers tend to contribute thousands of these.
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(data);
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (indexer->mIncludePrefixFile)
+        indexer->updateIncludePrefix(cursor, kind);
+    if (RTags::cursorType(kind) != RTags::Type_Other) {
+        CXSourceLocation location;
+        if (clang_isStatement(kind)) {
+            location = clang_getCursorLocation(cursor);
+        } else {
+            location = clang_getRangeStart(clang_Cursor_getSpellingNameRange(cursor, 0, 0));
+        }
+        CXFile file = nullptr;
+        clang_getSpellingLocation(location, &file, nullptr, nullptr, nullptr);
+        if (file) {
+            bool blocked = false;
+            if (!indexer->createLocation(file, 1, 1, &blocked).isNull() && blocked) {
+                ++indexer->mCursorsVisited;
+                ++indexer->mBlocked;
+                indexer->mLastCursor = cursor;
+                return ClangIndexer::state() == Stopped ? CXChildVisit_Break : CXChildVisit_Continue;
+            }
+        }
+    }
+    return visitorHelper(cursor, parent, data);
+}
+
+void ClangIndexer::updateIncludePrefix(const CXCursor &cursor, CXCursorKind kind)
+{
+    // The run of #includes at the top of the source file, before any macro
+    // or declaration, is what rdm can safely move into a shared PCH. clang
+    // hands us the whole preprocessing record before the first declaration
+    // so the prefix is cut at the offset of whichever comes first.
+    CXFile file = nullptr;
+    unsigned int offset = 0;
+    clang_getExpansionLocation(clang_getRangeStart(clang_getCursorExtent(cursor)), &file, nullptr, nullptr, &offset);
+    if (!file || file != mIncludePrefixFile)
+        return;
+    if (kind == CXCursor_InclusionDirective && offset < mIncludePrefixEnd) {
+        if (CXFile includedFile = clang_getIncludedFile(cursor)) {
+            const Location loc = createLocation(includedFile, 1, 1);
+            if (!loc.isNull()) {
+                mIncludePrefixCandidates.append(std::make_pair(offset, loc.fileId()));
+                return;
+            }
+        }
+    }
+    mIncludePrefixEnd = std::min(mIncludePrefixEnd, offset);
+    if (!clang_isPreprocessing(kind))
+        finishIncludePrefix();
+}
+
+void ClangIndexer::finishIncludePrefix()
+{
+    for (const auto &candidate : mIncludePrefixCandidates) {
+        if (candidate.first < mIncludePrefixEnd)
+            mIndexDataMessage.includePrefix().append(candidate.second);
+    }
+    mIncludePrefixCandidates.clear();
+    mIncludePrefixFile = nullptr;
+}
+
 CXChildVisitResult ClangIndexer::indexVisitor(CXCursor cursor)
 {
     ++mCursorsVisited;
@@ -1509,7 +1669,8 @@ std::unordered_set<CXCursor> ClangIndexer::addOverriddenCursors(const CXCursor &
 {
     // error() << "addOverriddenCursors" << cursor << location;
     std::unordered_set<CXCursor> ret;
-    std::function<void(const CXCursor &)> process = [location, &ret, this, &process](const CXCursor &cursor) {
+    const String derived = RTags::usr(c);
+    std::function<void(const CXCursor &)> process = [location, &ret, this, &process, &c, &derived](const CXCursor &cursor) {
         CXCursor *overridden;
         unsigned int count;
         clang_getOverriddenCursors(cursor, &overridden, &count);
@@ -1526,6 +1687,10 @@ std::unordered_set<CXCursor> ClangIndexer::addOverriddenCursors(const CXCursor &
 
                 // error() << location << "targets" << overridden[i];
                 unit(location)->targets[location][usr] = 0;
+                // only the direct overrides, the rest are reported by
+                // whoever visits the overridden methods
+                if (cursor == c)
+                    mIndexDataMessage.hierarchy().push_back({ usr, derived, location });
                 process(overridden[i]);
             }
             clang_disposeOverriddenCursors(overridden);
@@ -1756,6 +1921,7 @@ void ClangIndexer::handleBaseClassSpecifier(const CXCursor &cursor)
     }
     assert(!usr.empty());
     lastClass.baseClasses << usr;
+    mIndexDataMessage.hierarchy().push_back({ usr, lastClass.usr, mLastClass });
 }
 
 void ClangIndexer::extractArguments(List<Symbol::Argument> *arguments, const CXCursor &cursor)
@@ -2206,6 +2372,8 @@ bool ClangIndexer::parse()
 
     bool ok = false;
     mTranslationUnits.resize(mSources.size());
+    List<List<String> > arguments(mSources.size());
+    List<size_t> pending;
     for (size_t idx = 0; idx<mSources.size(); ++idx) {
         const Source &source = mSources.at(idx);
         if (testLog(LogLevel::Debug))
@@ -2215,7 +2383,7 @@ bool ClangIndexer::parse()
         //     error("[%s]", it.constData());
         // }
         bool usedPch = false;
-        const List<String> args = source.toCommandLine(commandLineFlags, &usedPch);
+        arguments[idx] = source.toCommandLine(commandLineFlags, &usedPch);
         if (usedPch)
             mIndexDataMessage.setFlag(IndexDataMessage::UsedPCH);
 
@@ -2237,13 +2405,37 @@ bool ClangIndexer::parse()
             }
         }
 
-        if (!unit) {
-            unit = RTags::TranslationUnit::create(mSourceFile, args, &unsavedFiles[0], unsavedIndex, flags,
-                                                  ClangIndexer::serverOpts() & Server::NoNoStdInc
-                                                  ? RTags::TranslationUnit::NoNoStdInc
-                                                  : RTags::TranslationUnit::None);
+        if (!unit)
+            pending.append(idx);
+    }
+
+    // Each TranslationUnit gets its own CXIndex so the builds for the
+    // different configurations of this file can be parsed concurrently.
+    // Visiting stays on this thread, it talks to rdm through mConnection.
+    const Flags<RTags::TranslationUnit::CreateFlags> unitFlags = (ClangIndexer::serverOpts() & Server::NoNoStdInc
+                                                                  ? RTags::TranslationUnit::NoNoStdInc
+                                                                  : RTags::TranslationUnit::None);
+    auto create = [&](size_t idx) {
+        mTranslationUnits[idx] = RTags::TranslationUnit::create(mSourceFile, arguments.at(idx), &unsavedFiles[0],
+                                                                unsavedIndex, flags, unitFlags);
+    };
+    if (pending.size() == 1) {
+        create(pending.front());
+    } else if (pending.size() > 1) {
+        List<std::thread> threads;
+        threads.reserve(pending.size() - 1);
+        for (size_t i=1; i<pending.size(); ++i)
+            threads.emplace_back(create, pending.at(i));
+        create(pending.front());
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    for (size_t idx = 0; idx<mSources.size(); ++idx) {
+        const Source &source = mSources.at(idx);
+        const std::shared_ptr<RTags::TranslationUnit> &unit = mTranslationUnits.at(idx);
+        if (pending.contains(idx))
             warning() << "CI::parse loading unit:" << unit->clangLine << " " << (unit->unit != nullptr);
-        }
 
         if (unit->unit) {
             if (pch && ClangIndexer::serverOpts() & Server::PCHEnabled) {
@@ -2258,12 +2450,13 @@ bool ClangIndexer::parse()
             }
 
             ok = true;
-            mParseDuration = sw.elapsed();
         } else {
             error() << "Failed to parse" << unit->clangLine;
             mIndexDataMessage.setFlag(IndexDataMessage::ParseFailure);
         }
     }
+    if (ok)
+        mParseDuration = sw.elapsed();
     if (mMode == Daemon) {
         if (ok) {
             mCachedSources = mSources;
@@ -2296,6 +2489,18 @@ static inline Map<String, Set<Location>> convertTargets(const Map<Location, Map<
     return ret;
 }
 
+static inline Map<Location, Set<String>> convertTargetUsrs(const Map<Location, Map<String, uint16_t>> &in, bool hasRoot)
+{
+    Map<Location, Set<String>> ret;
+    for (const auto &v : in) {
+        Set<String> &usrs = ret[v.first];
+        for (const auto &u : v.second) {
+            usrs.insert(hasRoot ? Sandbox::encoded(u.first) : u.first);
+        }
+    }
+    return ret;
+}
+
 static inline void encodeSymbols(Map<Location, Symbol> &symbols)
 {
     assert(Sandbox::hasRoot());
@@ -2311,6 +2516,7 @@ static inline void encodeSymbols(Map<Location, Symbol> &symbols)
 bool ClangIndexer::writeFiles(const Path &root, String &error)
 {
     size_t bytesWritten = 0;
+    uint64_t *encodeTime = &mIndexDataMessage.profile().encode;
     const Path p = Sandbox::encoded(mSourceFile);
     const bool hasRoot = Sandbox::hasRoot();
     const uint32_t fileId = mSources.front().fileId;
@@ -2319,6 +2525,15 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         assert(mIndexDataMessage.files().value(unit->first) & IndexDataMessage::Visited);
         String unitRoot = root;
         unitRoot << unit->first;
+        if (mReusedVisit) {
+            // nobody wrote these maps since we did, they already hold this
+            auto written = mVisitCache.written.find(unit->first);
+            if (written != mVisitCache.written.end() && written->second == Path(unitRoot + "/symbols").lastModifiedMs()) {
+                mWrittenMaps[unit->first] = written->second;
+                mIndexDataMessage.profile().unchangedFileMaps += 5;
+                return true;
+            }
+        }
         Path::mkdir(unitRoot, Path::Recursive);
         const Path path = Location::path(unit->first);
         if (unit->first != fileId) {
@@ -2362,39 +2577,41 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         }
 
         size_t w;
-        // for (const char *name : { "/symbols", "/targets", "/usrs", "/symnames", "/tokens" }) {
+        // for (const char *name : { "/symbols", "/targets", "/targetusrs", "/usrs", "/symnames" }) {
         //     if (Path::exists(unitRoot + "/symbols"))
         //         ::error() << (unitRoot + name) << "already exists";
         // }
-        if (!(w = FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit->second->symbols, fileMapOpts))) {
+        if (!(w = FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit->second->symbols, fileMapOpts, encodeTime))) {
             error = "Failed to write symbols";
             return false;
         }
         bytesWritten += w;
 
-        if (!(w = FileMap<String, Set<Location>>::write(unitRoot + "/targets", convertTargets(unit->second->targets, hasRoot), fileMapOpts))) {
+        if (!(w = FileMap<String, Set<Location>>::write(unitRoot + "/targets", convertTargets(unit->second->targets, hasRoot), fileMapOpts, encodeTime))) {
             error = "Failed to write targets";
             return false;
         }
         bytesWritten += w;
 
-        if (!(w += FileMap<String, Set<Location>>::write(unitRoot + "/usrs", unit->second->usrs, fileMapOpts))) {
-            error = "Failed to write usrs";
+        if (!(w = FileMap<Location, Set<String>>::write(unitRoot + "/targetusrs", convertTargetUsrs(unit->second->targets, hasRoot), fileMapOpts, encodeTime))) {
+            error = "Failed to write targetUsrs";
             return false;
         }
         bytesWritten += w;
 
-        if (!(w += FileMap<String, Set<Location>>::write(unitRoot + "/symnames", unit->second->symbolNames, fileMapOpts))) {
-            error = "Failed to write symbolNames";
+        if (!(w = FileMap<String, Set<Location>>::write(unitRoot + "/usrs", unit->second->usrs, fileMapOpts, encodeTime))) {
+            error = "Failed to write usrs";
             return false;
         }
         bytesWritten += w;
 
-        if (!(w += FileMap<uint32_t, Token>::write(unitRoot + "/tokens", unit->second->tokens, fileMapOpts))) {
+        if (!(w = FileMap<String, Set<Location>>::write(unitRoot + "/symnames", unit->second->symbolNames, fileMapOpts, encodeTime))) {
             error = "Failed to write symbolNames";
             return false;
         }
         bytesWritten += w;
+        if (mMode == Daemon)
+            mWrittenMaps[unit->first] = Path(unitRoot + "/symbols").lastModifiedMs();
         return true;
     };
 
@@ -2408,8 +2625,7 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
                       << "targets" << it->second->targets.size()
                       << "usrs" << it->second->usrs.size()
                       << "symbolNames" << it->second->symbolNames.size()
-                      << "symbols" << it->second->symbols.size()
-                      << "tokens" << it->second->tokens.size();
+                      << "symbols" << it->second->symbols.size();
             continue;
         }
         if (it->first == fileId) {
@@ -2451,55 +2667,128 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
 bool ClangIndexer::diagnose()
 {
     DiagnosticsProvider::diagnose();
-    for (size_t i=0; i<mTranslationUnits.size(); ++i) {
-        mCurrentTranslationUnit = i;
-        auto tu = mTranslationUnits.at(mCurrentTranslationUnit)->unit;
-        if (!tu) {
+    return true;
+}
+
+void ClangIndexer::hashFiles()
+{
+    // Files touched after the parse started may not be what clang saw, leave
+    // them out so rdm goes by their modification time.
+    const uint64_t parseTime = mIndexDataMessage.parseTime();
+    for (const auto &file : mIndexDataMessage.files()) {
+        if (!(file.second & IndexDataMessage::Visited))
             continue;
+        const Path path = Location::path(file.first);
+        FileContent content;
+        content.indexed = parseTime;
+        content.lastModified = path.lastModifiedMs();
+        if (!content.lastModified || content.lastModified >= parseTime)
+            continue;
+        // what we indexed for files with unsaved contents is the editor's
+        // buffer, saving that shouldn't need a reindex
+        auto unsaved = mUnsavedFiles.find(path);
+        if (unsaved != mUnsavedFiles.end()) {
+            content.hash = RTags::contentHash(unsaved->second);
+        } else {
+            content.hash = RTags::contentHash(path.readAll());
+            if (path.lastModifiedMs() != content.lastModified)
+                continue;
         }
-        for (const auto &it : mIndexDataMessage.files()) {
-            if (it.second & IndexDataMessage::Visited) {
-                const Location loc(it.first, 0, 0);
-                const Path path = loc.path();
-                CXFile file = clang_getFile(tu, path.constData());
-                if (file) {
-                    tokenize(file, it.first, path);
-                }
-            }
-        }
+        mIndexDataMessage.fileContents()[file.first] = content;
     }
+}
 
+static void collectInclusions(CXFile includedFile, CXSourceLocation *, unsigned int, CXClientData userData)
+{
+    Set<Path> &paths = *static_cast<Set<Path> *>(userData);
+    CXString fileName = clang_getFileName(includedFile);
+    if (const char *cstr = clang_getCString(fileName))
+        paths.insert(Path(cstr).resolved());
+    clang_disposeString(fileName);
+}
+
+bool ClangIndexer::reuseVisit()
+{
+    // Anything the units included that changed since the last visit, even if
+    // clang reparsed it, means visiting again. The files are also asked for
+    // again since rdm might give a header to some other source this time.
+    if (mMode != Daemon || !mVisitCache.valid || mVisitCache.sources != mSources)
+        return false;
+    for (const auto &content : mVisitCache.contents) {
+        const Path &path = content.first;
+        auto unsaved = mUnsavedFiles.find(path);
+        if (unsaved != mUnsavedFiles.end()) {
+            if (RTags::contentHash(unsaved->second) != content.second.hash)
+                return false;
+            continue;
+        }
+        const uint64_t lastModified = path.lastModifiedMs();
+        if (!lastModified)
+            return false;
+        if (lastModified != content.second.lastModified && RTags::contentHash(path.readAll()) != content.second.hash)
+            return false;
+    }
+    for (const auto &file : mVisitCache.files) {
+        bool blocked = false;
+        if (createLocation(file.second.first, 1, 1, &blocked).isNull())
+            return false;
+        if (blocked == static_cast<bool>(file.second.second & IndexDataMessage::Visited))
+            return false;
+    }
+    mUnits = mVisitCache.units;
+    mIndexDataMessage.includes() = mVisitCache.includes;
+    mIndexDataMessage.includePrefix() = mVisitCache.includePrefix;
+    mIndexDataMessage.hierarchy() = mVisitCache.hierarchy;
+    warning() << "reusing last visit of" << mSourceFile;
     return true;
 }
 
-void ClangIndexer::tokenize(CXFile file, uint32_t fileId, const Path &path)
+void ClangIndexer::cacheVisit()
 {
-    const auto &tu = mTranslationUnits.at(mCurrentTranslationUnit)->unit;
-    StopWatch sw;
-    const CXSourceLocation startLoc = clang_getLocationForOffset(tu, file, 0);
-    const CXSourceLocation endLoc = clang_getLocationForOffset(tu, file, path.fileSize());
-
-    CXSourceRange range = clang_getRange(startLoc, endLoc);
-    CXToken *tokens = nullptr;
-    unsigned numTokens = 0;
-    auto &map = unit(fileId)->tokens;
-    clang_tokenize(tu, range, &tokens, &numTokens);
-    for (unsigned i=0; i<numTokens; ++i) {
-        range = clang_getTokenExtent(tu, tokens[i]);
-        unsigned offset, endOffset;
-        const CXSourceLocation start = clang_getRangeStart(range);
-        clang_getSpellingLocation(start, nullptr, nullptr, nullptr, &offset);
-        clang_getSpellingLocation(clang_getRangeEnd(range), nullptr, nullptr, nullptr, &endOffset);
-        map[offset] = {
-            clang_getTokenKind(tokens[i]),
-            RTags::eatString(clang_getTokenSpelling(tu, tokens[i])),
-            createLocation(start),
-            offset,
-            endOffset - offset
-        };
+    const VisitCache previous = std::move(mVisitCache);
+    mVisitCache = VisitCache();
+    // sandboxed maps are encoded in place when they're written
+    if (Sandbox::hasRoot() || mIndexDataMessage.flags() & IndexDataMessage::ParseFailure)
+        return;
+
+    Set<Path> paths;
+    for (const auto &unit : mTranslationUnits) {
+        if (unit->unit)
+            clang_getInclusions(unit->unit, collectInclusions, &paths);
+    }
+    // a file that was touched after the parse started may not be what clang
+    // saw, don't cache anything then
+    const uint64_t parseTime = mIndexDataMessage.parseTime();
+    for (const Path &path : paths) {
+        FileContent content;
+        auto unsaved = mUnsavedFiles.find(path);
+        if (unsaved != mUnsavedFiles.end()) {
+            content.hash = RTags::contentHash(unsaved->second);
+        } else {
+            content.lastModified = path.lastModifiedMs();
+            if (!content.lastModified || content.lastModified >= parseTime)
+                return;
+            auto old = previous.contents.find(path);
+            if (old != previous.contents.end() && old->second.lastModified == content.lastModified) {
+                content.hash = old->second.hash;
+            } else {
+                content.hash = RTags::contentHash(path.readAll());
+                if (path.lastModifiedMs() != content.lastModified)
+                    return;
+            }
+        }
+        mVisitCache.contents[path] = content;
     }
 
-    clang_disposeTokens(tu, tokens, numTokens);
+    for (const auto &file : mIndexDataMessage.files())
+        mVisitCache.files[file.first] = std::make_pair(Location::path(file.first), file.second);
+    mVisitCache.sources = mSources;
+    mVisitCache.units = mUnits;
+    mVisitCache.includes = mIndexDataMessage.includes();
+    mVisitCache.includePrefix = mIndexDataMessage.includePrefix();
+    mVisitCache.hierarchy = mIndexDataMessage.hierarchy();
+    mVisitCache.written = std::move(mWrittenMaps);
+    mVisitCache.valid = true;
 }
 
 bool ClangIndexer::visit()
@@ -2513,7 +2802,14 @@ bool ClangIndexer::visit()
             continue;
         }
 
-        visit(clang_getTranslationUnitCursor(unit->unit));
+        mIncludePrefixFile = i ? nullptr : clang_getFile(unit->unit, mSourceFile.constData());
+        mIncludePrefixEnd = std::numeric_limits<unsigned int>::max();
+        const CXCursor root = clang_getTranslationUnitCursor(unit->unit);
+        mParents.push_back(root);
+        clang_visitChildren(root, topLevelVisitor, this);
+        mParents.removeLast();
+        if (mIncludePrefixFile)
+            finishIncludePrefix();
 
         if (testLog(LogLevel::VerboseDebug)) {
             VerboseVisitorUserData u = { 0, "<VerboseVisitor " + unit->clangLine + ">\n", this };
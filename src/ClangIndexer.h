@@ -17,7 +17,6 @@
 #define ClangIndexer_h
 
 #include <sys/stat.h>
-#include "Token.h"
 
 #include "IndexDataMessage.h"
 #include "rct/Hash.h"
@@ -26,6 +25,7 @@
 #include "RTags.h"
 #include "Server.h"
 #include "Symbol.h"
+#include <unordered_map>
 #include <unordered_set>
 
 struct Unit;
@@ -63,8 +63,10 @@ private:
     bool diagnose();
     bool visit();
     bool parse();
-    void tokenize(CXFile file, uint32_t fileId, const Path &path);
     bool writeFiles(const Path &root, String &error);
+    void hashFiles();
+    bool reuseVisit();
+    void cacheVisit();
 
     void addFileSymbol(uint32_t file);
     int symbolLength(CXCursorKind kind, const CXCursor &cursor);
@@ -76,6 +78,8 @@ private:
     // DiagnosticsProvider
     using RTags::DiagnosticsProvider::createLocation;
     virtual Location createLocation(const Path &file, unsigned int line, unsigned int col, bool *blocked = nullptr) override;
+    virtual Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = nullptr) override;
+    bool isBlocked(uint32_t fileId);
     virtual CXTranslationUnit unit(size_t u) const override;
     virtual size_t unitCount() const override
     {
@@ -124,6 +128,9 @@ private:
     }
     CXChildVisitResult indexVisitor(CXCursor cursor);
     static CXChildVisitResult visitorHelper(CXCursor cursor, CXCursor, CXClientData userData);
+    static CXChildVisitResult topLevelVisitor(CXCursor cursor, CXCursor parent, CXClientData userData);
+    void updateIncludePrefix(const CXCursor &cursor, CXCursorKind kind);
+    void finishIncludePrefix();
     static CXChildVisitResult verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult resolveAutoTypeRefVisitor(CXCursor cursor, CXCursor, CXClientData data);
 
@@ -134,7 +141,6 @@ private:
         Map<Location, Map<String, uint16_t>> targets;
         Map<String, Set<Location>> usrs;
         Map<String, Set<Location>> symbolNames;
-        Map<uint32_t, Token> tokens;
     };
 
     std::shared_ptr<Unit> &unit(uint32_t fileId)
@@ -166,10 +172,58 @@ private:
 
     Hash<uint32_t, std::shared_ptr<Unit>> mUnits;
 
+    // fileId and blocked state of every file we've created locations for in
+    // this job. Keyed on clang_getFileUniqueID since CXFiles are per unit and
+    // diagnose() mixes files from all of them.
+    struct FileUniqueId {
+        unsigned long long data[3];
+        bool operator==(const FileUniqueId &other) const
+        {
+            return !memcmp(data, other.data, sizeof(data));
+        }
+    };
+    struct FileUniqueIdHash {
+        size_t operator()(const FileUniqueId &id) const
+        {
+            return std::hash<unsigned long long>()(id.data[0] ^ (id.data[1] * 31) ^ (id.data[2] * 1000003));
+        }
+    };
+    struct FileCacheEntry {
+        uint32_t fileId;
+        enum State {
+            Unknown, // only looked up without a blocked pointer so far
+            Blocked,
+            Allowed
+        } state;
+    };
+    std::unordered_map<FileUniqueId, FileCacheEntry, FileUniqueIdHash> mFileCache;
+    // main file of the first unit until its first declaration was seen, the
+    // #includes found so far by offset and the offset the prefix ends at
+    CXFile mIncludePrefixFile { nullptr };
+    List<std::pair<unsigned int, uint32_t>> mIncludePrefixCandidates;
+    unsigned int mIncludePrefixEnd { 0 };
+
     const Mode mMode;
     Path mProject;
     uint32_t mCompileCommandsFileId;
     SourceList mSources, mCachedSources;
+    // Daemon only. What the last full visit of mCachedSources produced and
+    // the state of every file its units included at the time. If none of
+    // them changed and rdm hands us the same files the result is reused.
+    struct VisitCache {
+        bool valid { false };
+        SourceList sources;
+        Hash<Path, FileContent> contents;
+        Hash<uint32_t, std::pair<Path, Flags<IndexDataMessage::FileFlag>>> files;
+        Hash<uint32_t, std::shared_ptr<Unit>> units;
+        Includes includes;
+        List<uint32_t> includePrefix;
+        HierarchyEdges hierarchy;
+        // mtime of the symbols map we wrote last for each file
+        Hash<uint32_t, uint64_t> written;
+    } mVisitCache;
+    bool mReusedVisit { false };
+    Hash<uint32_t, uint64_t> mWrittenMaps;
     Path mSourceFile;
     IndexDataMessage mIndexDataMessage;
     List<std::shared_ptr<RTags::TranslationUnit>> mTranslationUnits, mCachedTranslationUnits;
@@ -17,8 +17,11 @@
 
 #include <assert.h>
 #include <string.h>
+#include <algorithm>
 #include <functional>
 #include <list>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 #include "IndexDataMessage.h"
@@ -42,7 +45,7 @@
 using namespace nlohmann;
 #endif
 
-static uint64_t start = 0;
+static thread_local uint64_t start = 0;
 #define LOG()                                                           \
     if (Server::instance()->options().options & Server::CompletionLogs) \
         error() << "CODE COMPLETION"                                    \
@@ -50,8 +53,9 @@ static uint64_t start = 0;
                                       static_cast<double>(Rct::monoMs() - ::start) / 1000.0, \
                                       Rct::currentTimeString().constData())
 
-CompletionThread::CompletionThread(int cacheSize)
-    : mShutdown(false), mCacheSize(cacheSize), mDump(nullptr)
+CompletionThread::CompletionThread(int cacheSize, int cacheMemory, int workerCount)
+    : mShutdown(false), mCacheSize(cacheSize), mCacheMemory(static_cast<uint64_t>(std::max(cacheMemory, 0)) * 1024 * 1024),
+      mWorkers(std::max(workerCount, 1))
 {
 }
 
@@ -61,57 +65,86 @@ CompletionThread::~CompletionThread()
 }
 
 void CompletionThread::run()
+{
+    List<std::thread> threads;
+    threads.reserve(mWorkers.size() - 1);
+    for (size_t i=1; i<mWorkers.size(); ++i)
+        threads.emplace_back(&CompletionThread::work, this, i);
+    work(0);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (Worker &worker : mWorkers) {
+        for (auto it = worker.pending.begin(); it != worker.pending.end(); ++it) {
+            delete *it;
+        }
+        worker.pending.clear();
+    }
+}
+
+void CompletionThread::work(size_t idx)
 {
     while (true) {
         Request *request = nullptr;
-        Dump *dump = nullptr;
         {
             std::unique_lock<std::mutex> lock(mMutex);
-            while (!mShutdown && mPending.empty() && !mDump) {
+            Worker &worker = mWorkers[idx];
+            worker.busy = false;
+            worker.active = 0;
+            while (!mShutdown && worker.pending.empty()) {
                 mCondition.wait(lock);
             }
-            if (mShutdown) {
-                for (auto it = mPending.begin(); it != mPending.end(); ++it) {
-                    delete *it;
-                }
-                mPending.clear();
-                if (mDump) {
-                    std::unique_lock<std::mutex> dumpLock(mDump->mutex);
-                    mDump->done = true;
-                    mDump->cond.notify_one();
-                    mDump = nullptr;
-                }
+            if (mShutdown)
                 break;
-            } else if (mDump) {
-                std::swap(dump, mDump);
-            } else {
-                assert(!mPending.empty());
-                request = mPending.takeFirst();
-            }
-        }
-        if (dump) {
-            std::unique_lock<std::mutex> lock(dump->mutex);
-            Log out(&dump->string);
-            for (SourceFile *cache = mCacheList.front(); cache; cache = cache->next) {
-                out << cache->source
-                    << "\nparseTime:" << cache->parseTime
-                    << "\nreparseTime:" << cache->reparseTime
-                    << "\ncompletions:" << cache->completions
-                    << "\ncompletionTime:" << cache->codeCompleteTime
-                    << (cache->completions
-                        ? String::format<32>("(avg: %.2f)",
-                                             (static_cast<double>(cache->codeCompleteTime) / cache->completions))
-                        : String())
-                    << "\ntranslationUnit:" << cache->translationUnit << "\n";
-            }
-            dump->done = true;
-            dump->cond.notify_one();
-        } else {
-            assert(request);
-            process(request);
-            delete request;
+            request = worker.pending.takeFirst();
+            worker.active = request->source.fileId;
+            worker.busy = true;
         }
+        process(request, idx);
+        delete request;
+    }
+}
+
+size_t CompletionThread::workerFor(uint32_t fileId)
+{
+    auto it = mAffinity.find(fileId);
+    if (it != mAffinity.end())
+        return it->second;
+
+    auto load = [this](size_t idx) { return mWorkers.at(idx).pending.size() + (mWorkers.at(idx).busy ? 1 : 0); };
+    size_t best = 0;
+    for (size_t i=1; i<mWorkers.size(); ++i) {
+        const size_t l = load(i), bestLoad = load(best);
+        if (l < bestLoad || (l == bestLoad && mWorkers.at(i).sources < mWorkers.at(best).sources))
+            best = i;
+    }
+    mAffinity[fileId] = best;
+    return best;
+}
+
+// Must be called with mMutex held.
+bool CompletionThread::isActive(uint32_t fileId) const
+{
+    for (const Worker &worker : mWorkers) {
+        if (worker.active == fileId)
+            return true;
+    }
+    return false;
+}
+
+// Must be called with mMutex held. Unpins a file whose unit is gone unless
+// a worker is handling a request for it or still has one queued.
+void CompletionThread::releaseWorker(uint32_t fileId)
+{
+    auto it = mAffinity.find(fileId);
+    if (it == mAffinity.end() || isActive(fileId))
+        return;
+    for (const Request *request : mWorkers[it->second].pending) {
+        if (request->source.fileId == fileId)
+            return;
     }
+    mAffinity.erase(it);
 }
 
 void CompletionThread::completeAt(Source &&source, Location location,
@@ -124,17 +157,18 @@ void CompletionThread::completeAt(Source &&source, Location location,
 
     Request *request = new Request({ std::forward<Source>(source), location, flags, max, unsavedFiles, prefix, conn});
     std::unique_lock<std::mutex> lock(mMutex);
-    auto it = mPending.begin();
-    while (it != mPending.end()) {
-        if ((*it)->source == source) {
+    LinkedList<Request*> &pending = mWorkers[workerFor(request->source.fileId)].pending;
+    auto it = pending.begin();
+    while (it != pending.end()) {
+        if ((*it)->source == request->source) {
             delete *it;
-            mPending.erase(it);
+            pending.erase(it);
             break;
         }
         ++it;
     }
-    mPending.push_front(request);
-    mCondition.notify_one();
+    pending.push_front(request);
+    mCondition.notify_all();
 }
 
 void CompletionThread::prepare(Source &&source, const UnsavedFiles &unsavedFiles)
@@ -145,7 +179,8 @@ void CompletionThread::prepare(Source &&source, const UnsavedFiles &unsavedFiles
         error() << "CODE COMPLETION prepare" << Rct::currentTimeString() << source.sourceFile() << unsavedSize;
     }
     std::unique_lock<std::mutex> lock(mMutex);
-    for (auto req : mPending) {
+    LinkedList<Request*> &pending = mWorkers[workerFor(source.fileId)].pending;
+    for (auto req : pending) {
         if (req->source == source) {
             req->unsavedFiles = unsavedFiles;
             return;
@@ -153,34 +188,55 @@ void CompletionThread::prepare(Source &&source, const UnsavedFiles &unsavedFiles
     }
 
     Request *request = new Request({ std::forward<Source>(source), Location(), WarmUp, -1, unsavedFiles, String(), std::shared_ptr<Connection>() });
-    mPending.push_back(request);
-    mCondition.notify_one();
+    pending.push_back(request);
+    mCondition.notify_all();
 }
 
 String CompletionThread::dump()
 {
-    Dump dump;
-    dump.done = false;
+    String ret;
     {
+        Log out(&ret);
         std::unique_lock<std::mutex> lock(mMutex);
-        if (mDump)
-            return String(); // dump in progress
-
-        mDump = &dump;
-        mCondition.notify_one();
-    }
-    std::unique_lock<std::mutex> lock(dump.mutex);
-    while (!dump.done) {
-        dump.cond.wait(lock);
+        for (size_t i=0; i<mWorkers.size(); ++i) {
+            const Worker &worker = mWorkers.at(i);
+            out << "worker" << i << (worker.busy ? "busy" : "idle")
+                << "pending:" << worker.pending.size()
+                << "translationUnits:" << worker.sources << "\n";
+        }
+        out << "memory:" << String::format<32>("%.1fmb", static_cast<double>(mMemory) / (1024 * 1024));
+        if (mCacheMemory)
+            out << "budget:" << String::format<32>("%.1fmb", static_cast<double>(mCacheMemory) / (1024 * 1024));
+        out << "\n";
+        for (SourceFile *cache = mCacheList.front(); cache; cache = cache->next) {
+            out << cache->source
+                << "\nworker:" << cache->worker
+                << "\nmemory:" << String::format<64>("%.1fmb (mapped: %.1fmb)",
+                                                      static_cast<double>(cache->memory) / (1024 * 1024),
+                                                      static_cast<double>(cache->mappedMemory) / (1024 * 1024))
+                << "\nparseTime:" << cache->parseTime
+                << "\nreparseTime:" << cache->reparseTime
+                << "\ncompletions:" << cache->completions
+                << "\ncompletionTime:" << cache->codeCompleteTime
+                << (cache->completions
+                    ? String::format<32>("(avg: %.2f)",
+                                         (static_cast<double>(cache->codeCompleteTime) / cache->completions))
+                    : String());
+            if (cache->busy) {
+                out << "\ntranslationUnit: busy\n";
+            } else {
+                out << "\ntranslationUnit:" << cache->translationUnit << "\n";
+            }
+        }
     }
-    return std::move(dump.string);
+    return ret;
 }
 
 void CompletionThread::stop()
 {
     std::unique_lock<std::mutex> lock(mMutex);
     mShutdown = true;
-    mCondition.notify_one();
+    mCondition.notify_all();
 }
 
 bool CompletionThread::compareCompletionCandidates(const Completions::Candidate *l,
@@ -197,7 +253,118 @@ bool CompletionThread::compareCompletionCandidates(const Completions::Candidate
     return l->completion < r->completion;
 }
 
-void CompletionThread::process(Request *request)
+// Hashes everything a completion at location depends on: the text in
+// front of the completion point and all other unsaved buffers. Files
+// without unsaved contents are identified by their modification time.
+static size_t completionContext(const UnsavedFiles &unsavedFiles, Location location)
+{
+    const Path path = location.path();
+    const std::hash<std::string_view> hash;
+    size_t ret = 0;
+    bool found = false;
+    for (const auto &unsaved : unsavedFiles) {
+        const char *data = unsaved.second.constData();
+        size_t length = unsaved.second.size();
+        if (unsaved.first == path) {
+            found = true;
+            size_t pos = 0;
+            for (unsigned int line = 1; line < location.line() && pos < length; ++pos) {
+                if (data[pos] == '\n')
+                    ++line;
+            }
+            length = std::min(length, pos + location.column() - 1);
+        }
+        ret ^= hash(std::string_view(data, length)) + 31 * hash(std::string_view(unsaved.first.constData(), unsaved.first.size()));
+    }
+    if (!found)
+        ret ^= path.lastModifiedMs();
+    return ret;
+}
+
+static void translationUnitMemory(CXTranslationUnit unit, uint64_t &memory, uint64_t &mappedMemory)
+{
+    memory = mappedMemory = 0;
+    CXTUResourceUsage usage = clang_getCXTUResourceUsage(unit);
+    for (unsigned int i=0; i<usage.numEntries; ++i) {
+        switch (usage.entries[i].kind) {
+        case CXTUResourceUsage_SourceManager_Membuffer_MMap:
+        case CXTUResourceUsage_ExternalASTSource_Membuffer_MMap:
+            mappedMemory += usage.entries[i].amount;
+            break;
+        default:
+            memory += usage.entries[i].amount;
+            break;
+        }
+    }
+    clang_disposeCXTUResourceUsage(usage);
+}
+
+// Must be called with mMutex held. Units that are being worked on, or whose
+// file a worker has a request in flight for, stay put. Over the count limit
+// the least recently used unit goes, over the memory budget the largest unit
+// among the older half of the list does, so one huge unit doesn't push out
+// several small recent ones.
+void CompletionThread::evict(const SourceFile *keep)
+{
+    while (true) {
+        const bool overMemory = mCacheMemory && mMemory > mCacheMemory;
+        if (!overMemory && mCacheMap.size() <= mCacheSize)
+            break;
+        const size_t half = (mCacheMap.size() + 1) / 2;
+        SourceFile *victim = nullptr;
+        size_t idx = 0;
+        for (SourceFile *c = mCacheList.front(); c; c = c->next, ++idx) {
+            if (c == keep || c->busy || isActive(c->source.fileId))
+                continue;
+            if (!victim) {
+                victim = c;
+            } else if (!overMemory || idx >= half) {
+                break;
+            } else if (c->memory > victim->memory) {
+                victim = c;
+            }
+        }
+        if (!victim)
+            break;
+        LOG() << (overMemory ? "over cache memory budget. discarding" : "over cache limit. discarding")
+              << victim->source.sourceFile() << victim->memory << "bytes";
+        mCacheMap.remove(victim->source.fileId);
+        mCacheList.remove(victim);
+        --mWorkers[victim->worker].sources;
+        mMemory -= victim->memory;
+        releaseWorker(victim->source.fileId);
+        delete victim;
+    }
+}
+
+bool CompletionThread::isSuperseded(uint32_t fileId, size_t worker) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const Request *request : mWorkers[worker].pending) {
+        if (request->conn && !(request->flags & (WarmUp|Diagnose)) && request->source.fileId == fileId)
+            return true;
+    }
+    return false;
+}
+
+void CompletionThread::sendCompletions(List<CompletionCandidate *> &candidates, Request *request)
+{
+    List<std::unique_ptr<MatchResult>> matches = StringTokenizer::find_and_sort_matches(candidates, request->prefix);
+
+    if ((request->max != -1) && (static_cast<size_t>(request->max) < matches.size())) {
+        matches.resize(request->max);
+    }
+
+    if (!matches.empty()) {
+        printCompletions(matches, request);
+        LOG() << "Sent" << matches.size() << "completions for" << request->location;
+    } else {
+        LOG() << "No completions available for" << request->location;
+        printCompletions(List<std::unique_ptr<MatchResult>>(), request);
+    }
+}
+
+void CompletionThread::process(Request *request, size_t worker)
 {
     ::start = Rct::monoMs();
     LOG() << "processing" << request->toString();
@@ -206,37 +373,71 @@ void CompletionThread::process(Request *request)
     int reparseTime = 0;
     int completeTime = 0;
     int processTime = 0;
-    mMutex.lock();
-    SourceFile *&cache = mCacheMap[request->source.fileId];
+    bool completed = false;
+    bool measured = false;
+    uint64_t memory = 0, mappedMemory = 0;
+    std::unique_lock<std::mutex> lock(mMutex);
+    SourceFile *cache = mCacheMap.value(request->source.fileId);
+    // A file's requests all go to the worker it is pinned to so this
+    // shouldn't happen, but never touch a unit another worker is using.
+    while (cache && cache->busy) {
+        assert(cache->worker != worker);
+        mCondition.wait(lock);
+        cache = mCacheMap.value(request->source.fileId);
+    }
 
     if (cache && cache->source != request->source) {
         LOG() << "cached sourcefile doesn't match source, discarding" << request->source.sourceFile()
               << cache->source << "vs" << request->source;
+        mCacheMap.remove(cache->source.fileId);
         mCacheList.remove(cache);
+        --mWorkers[cache->worker].sources;
+        mMemory -= cache->memory;
+        releaseWorker(cache->source.fileId);
         delete cache;
         cache = nullptr;
     }
     if (!cache) {
         cache = new SourceFile;
         LOG() << "creating source file for" << request->source.sourceFile();
+        cache->source = std::move(request->source);
+        assert(!cache->source.defines.contains(Source::Define("RTAGS", String(), Source::Define::NoValue)));
+        cache->worker = worker;
+        mAffinity[cache->source.fileId] = worker;
+        ++mWorkers[worker].sources;
+        mCacheMap[cache->source.fileId] = cache;
         mCacheList.push_back(cache);
-        while (mCacheMap.size() > mCacheSize) {
-            SourceFile *c = mCacheList.removeFirst();
-            LOG() << "over cache limit. discarding" << c->source.sourceFile();
-            mCacheMap.remove(c->source.fileId);
-            delete c;
-        }
+        evict(cache);
     } else {
         mCacheList.moveToEnd(cache);
     }
-    mMutex.unlock();
-
-    assert(!cache->translationUnit || cache->source == request->source);
-    if (!cache->translationUnit) {
-        cache->source = std::move(request->source);
-        assert(!cache->source.defines.contains(Source::Define("RTAGS", String(), Source::Define::NoValue)));
-    }
+    cache->busy = true;
+    lock.unlock();
+
+    struct Release {
+        ~Release() { func(); }
+        std::function<void()> func;
+    } release = { [&]() {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (parseTime)
+                cache->parseTime = parseTime;
+            if (reparseTime)
+                cache->reparseTime = reparseTime;
+            if (completed) {
+                cache->codeCompleteTime = completeTime;
+                ++cache->completions;
+            }
+            cache->busy = false;
+            if (measured) {
+                mMemory = mMemory - cache->memory + memory;
+                cache->memory = memory;
+                cache->mappedMemory = mappedMemory;
+                evict(cache);
+            }
+            mCondition.notify_all();
+        } };
 
+    assert(cache->source == request->source || !cache->translationUnit);
     const Path sourceFile = cache->source.sourceFile();
     List<CXUnsavedFile> unsavedFiles;
     unsavedFiles.reserve(request->unsavedFiles.size());
@@ -244,6 +445,20 @@ void CompletionThread::process(Request *request)
         unsavedFiles.push_back({ it.first.constData(), it.second.constData(), static_cast<unsigned long>(it.second.size()) });
     }
 
+    const size_t context = completionContext(request->unsavedFiles, request->location);
+    if (cache->translationUnit && cache->lastCompletion.valid && !(request->flags & (WarmUp|Diagnose))
+        && cache->lastCompletion.location == request->location
+        && cache->lastCompletion.includeMacros == static_cast<bool>(request->flags & IncludeMacros)
+        && cache->lastCompletion.context == context) {
+        List<CompletionCandidate *> candidates;
+        candidates.reserve(cache->lastCompletion.candidates.size());
+        for (const CompletionCandidate &candidate : cache->lastCompletion.candidates)
+            candidates.push_back(new CompletionCandidate(candidate));
+        LOG() << "Reusing" << candidates.size() << "completions for" << request->location << "with prefix" << request->prefix;
+        sendCompletions(candidates, request);
+        return;
+    }
+
     const auto &options = Server::instance()->options();
     bool reparse = false;
     if (!cache->translationUnit) {
@@ -277,7 +492,7 @@ void CompletionThread::process(Request *request)
                                                                 unsavedFiles.data(), static_cast<int>(unsavedFiles.size()), flags,
                                                                 RTags::TranslationUnit::None);
         // error() << "PARSING" << clangLine;
-        parseTime = cache->parseTime = sw.elapsed();
+        parseTime = sw.elapsed();
         // with clang 3.8 it definitely seems like we have to reparse once to
         // generate the preamble. Even with CXTranslationUnit_CreatePreambleOnFirstParse
         if (!cache->translationUnit) {
@@ -308,8 +523,14 @@ void CompletionThread::process(Request *request)
         assert(cache->translationUnit);
         LOG() << "reparsing translation unit" << cache->source.sourceFile();
         cache->translationUnit->reparse(unsavedFiles.data(), static_cast<int>(unsavedFiles.size()));
-        reparseTime = cache->reparseTime = sw.elapsed();
+        reparseTime = sw.elapsed();
         cache->unsavedFiles = std::move(request->unsavedFiles);
+        cache->lastCompletion.valid = false;
+    }
+
+    if (reparse) {
+        translationUnitMemory(cache->translationUnit->unit, memory, mappedMemory);
+        measured = true;
     }
 
 
@@ -329,10 +550,10 @@ void CompletionThread::process(Request *request)
     CXCodeCompleteResults *results = clang_codeCompleteAt(cache->translationUnit->unit, request->location.path().c_str(),
                                                           request->location.line(), request->location.column(),
                                                           unsavedFiles.data(), static_cast<unsigned int>(unsavedFiles.size()), completionFlags);
-    completeTime = cache->codeCompleteTime = sw.restart();
+    completeTime = sw.restart();
     LOG() << "Generated" << (results ? results->NumResults : 0) << "completions for" << request->location << "from" << sourceFile << (results ? "successfully" : "unsuccessfully") << "in" << completeTime << "ms";
 
-    ++cache->completions;
+    completed = true;
     if (results) {
         List<CompletionCandidate *> candidates;
         candidates.reserve(results->NumResults);
@@ -409,24 +630,30 @@ void CompletionThread::process(Request *request)
             }
         }
 
-        List<std::unique_ptr<MatchResult>> matches = StringTokenizer::find_and_sort_matches(candidates, request->prefix);
-
-        if ((request->max != -1) && (static_cast<size_t>(request->max) < matches.size())) {
-            matches.resize(request->max);
+        cache->lastCompletion.valid = true;
+        cache->lastCompletion.location = request->location;
+        cache->lastCompletion.includeMacros = request->flags & IncludeMacros;
+        cache->lastCompletion.context = context;
+        cache->lastCompletion.candidates.clear();
+        cache->lastCompletion.candidates.reserve(candidates.size());
+        for (const CompletionCandidate *candidate : candidates)
+            cache->lastCompletion.candidates.push_back(*candidate);
+
+        if (request->conn && isSuperseded(cache->source.fileId, worker)) {
+            // a newer request for this unit is already queued and will
+            // refilter these candidates, don't bother sending them
+            LOG() << "Completion for" << request->location << "superseded";
+            for (CompletionCandidate *candidate : candidates)
+                delete candidate;
+            clang_disposeCodeCompleteResults(results);
+            return;
         }
 
-        if (!matches.empty()) {
-            printCompletions(matches, request);
-            processTime = sw.elapsed();
-            LOG() << "Sent" << matches.size() << "completions for" << request->location;
-            warning("Processed %s, parse %d/%d, complete %d, process %d => %d completions (unsaved %zu)",
-                    request->location.toString().constData(),
-                    parseTime, reparseTime, completeTime, processTime, nodeCount, unsaved ? unsaved->size() : 0);
-
-        } else {
-            LOG() << "No completions available for" << request->location;
-            printCompletions(List<std::unique_ptr<MatchResult>>(), request);
-        }
+        sendCompletions(candidates, request);
+        processTime = sw.elapsed();
+        warning("Processed %s, parse %d/%d, complete %d, process %d => %d completions (unsaved %zu)",
+                request->location.toString().constData(),
+                parseTime, reparseTime, completeTime, processTime, nodeCount, unsaved ? unsaved->size() : 0);
 
         if (options.options & Server::CompletionDiagnostics)
             processDiagnostics(request, results, cache->translationUnit->unit);
@@ -657,7 +884,8 @@ void CompletionThread::reparse(const std::shared_ptr<Project> &/*project*/, uint
     if (!source.isValid())
         return;
 
-    for (auto req : mPending) {
+    LinkedList<Request*> &pending = mWorkers[workerFor(fileId)].pending;
+    for (auto req : pending) {
         if (req->source == source) {
             return;
         }
@@ -667,8 +895,8 @@ void CompletionThread::reparse(const std::shared_ptr<Project> &/*project*/, uint
         error() << "CODE COMPLETION reparse" << Rct::currentTimeString() << source.sourceFile();
 
     Request *request = new Request({ std::forward<Source>(source), Location(), Diagnose, -1, UnsavedFiles(), String(), std::shared_ptr<Connection>() });
-    mPending.push_back(request);
-    mCondition.notify_one();
+    pending.push_back(request);
+    mCondition.notify_all();
 }
 
 String CompletionThread::Request::toString() const
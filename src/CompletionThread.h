@@ -37,6 +37,7 @@
 #include "rct/List.h"
 #include "rct/Set.h"
 #include "rct/String.h"
+#include "rct/StringTokenizer.h"
 #include "rct/Value.h"
 
 struct MatchResult;
@@ -45,7 +46,7 @@ class Project;
 class CompletionThread : public Thread
 {
 public:
-    CompletionThread(int cacheSize);
+    CompletionThread(int cacheSize, int cacheMemory = 0, int workerCount = 1);
     ~CompletionThread();
 
     virtual void run() override;
@@ -72,11 +73,21 @@ private:
     struct Request;
 
     void processDiagnostics(const Request *request, CXCodeCompleteResults *results, CXTranslationUnit unit);
-    void process(Request *request);
+    void process(Request *request, size_t worker);
+    void sendCompletions(List<CompletionCandidate *> &candidates, Request *request);
+    bool isSuperseded(uint32_t fileId, size_t worker) const;
+    void work(size_t worker);
+    size_t workerFor(uint32_t fileId);
+    void releaseWorker(uint32_t fileId);
+    bool isActive(uint32_t fileId) const;
+    struct SourceFile;
+    void evict(const SourceFile *keep);
 
     Set<uint32_t> mWatched;
     bool mShutdown;
     const size_t mCacheSize;
+    const uint64_t mCacheMemory; // bytes, 0 means unlimited
+    uint64_t mMemory { 0 };
     struct Request {
         ~Request()
         {
@@ -92,13 +103,18 @@ private:
         String prefix;
         std::shared_ptr<Connection> conn;
     };
-    LinkedList<Request*> mPending;
-    struct Dump {
-        bool done;
-        std::mutex mutex;
-        std::condition_variable cond;
-        String string;
-    } *mDump;
+    // Every cached translation unit is pinned to one worker so libclang
+    // never sees the same unit on two threads. Interactive requests go to
+    // the front of a worker's queue, warm-ups and diagnostics to the back.
+    // active is the file of the request a worker has taken off its queue.
+    struct Worker {
+        LinkedList<Request*> pending;
+        size_t sources { 0 };
+        uint32_t active { 0 };
+        bool busy { false };
+    };
+    List<Worker> mWorkers;
+    Hash<uint32_t, size_t> mAffinity;
 
     struct Completions {
         Completions(Location loc) : location(loc), next(nullptr), prev(nullptr) {}
@@ -140,14 +156,31 @@ private:
 
     struct SourceFile {
         SourceFile()
-            : lastModified(0), parseTime(0), reparseTime(0), codeCompleteTime(0), completions(0), next(nullptr), prev(nullptr)
+            : lastModified(0), parseTime(0), reparseTime(0), codeCompleteTime(0), completions(0),
+              memory(0), mappedMemory(0), worker(0), busy(false), next(nullptr), prev(nullptr)
         {}
         std::shared_ptr<RTags::TranslationUnit> translationUnit;
         UnsavedFiles unsavedFiles;
         uint64_t lastModified;
         uint64_t parseTime, reparseTime, codeCompleteTime; // ms
         size_t completions;
+        // Heap memory libclang reports for the unit. Mapped memory (mostly
+        // the preamble, which lives in a temporary file) is paged in and out
+        // by the kernel and isn't charged against mCacheMemory.
+        uint64_t memory, mappedMemory; // bytes
+        size_t worker;
+        bool busy;
         Source source;
+        // Candidates from the last clang_codeCompleteAt. As long as nothing
+        // in front of the completion point changed they are simply
+        // refiltered with the new prefix.
+        struct {
+            bool valid { false };
+            Location location;
+            bool includeMacros { false };
+            size_t context { 0 };
+            List<CompletionCandidate> candidates;
+        } lastCompletion;
         SourceFile *next, *prev;
     };
 
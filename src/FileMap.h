@@ -21,6 +21,7 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <chrono>
 #include <functional>
 #include <limits>
 
@@ -198,15 +199,27 @@ public:
         return read<Value>(valuesSegment(), index);
     }
 
-    uint32_t lowerBound(const Key &k, bool *match = nullptr) const
+    // the serialized value, for reading parts of it without decoding the
+    // whole thing, see SymbolView
+    const char *valueData(uint32_t index) const
     {
-        if (!mCount) {
+        assert(index < mCount);
+        assert(!FixedSize<Value>::value);
+        uint32_t offset;
+        memcpy(&offset, valuesSegment() + (sizeof(uint32_t) * index), sizeof(offset));
+        return mPointer + offset;
+    }
+
+    // first lets callers looking up sorted keys skip what they've passed
+    uint32_t lowerBound(const Key &k, bool *match = nullptr, uint32_t first = 0) const
+    {
+        if (first >= mCount) {
             if (match)
                 *match = false;
             return std::numeric_limits<uint32_t>::max();
 
         }
-        int lower = 0;
+        int lower = first;
         int upper = mCount - 1;
 
         do {
@@ -276,7 +289,8 @@ public:
         }
         return out;
     }
-    static size_t write(const Path &path, const Map<Key, Value> &map, uint32_t options)
+    // if encodeTime is passed the microseconds spent encoding are added to it
+    static size_t write(const Path &path, const Map<Key, Value> &map, uint32_t options, uint64_t *encodeTime = nullptr)
     {
         int fd = open(path.constData(), O_RDWR|O_CREAT, 0644);
         if (fd == -1) {
@@ -290,7 +304,10 @@ public:
             ::close(fd);
             return 0;
         }
+        const auto encodeStart = std::chrono::steady_clock::now();
         const String data = encode(map);
+        if (encodeTime)
+            *encodeTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - encodeStart).count();
         bool ok = ::ftruncate(fd, data.size()) != -1;
         if (!ok) {
             if (!(options & NoLock))
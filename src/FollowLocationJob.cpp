@@ -29,7 +29,7 @@
 FollowLocationJob::FollowLocationJob(Location loc,
                                      const std::shared_ptr<QueryMessage> &query,
                                      List<std::shared_ptr<Project>> &&projects)
-    : QueryJob(query, std::move(projects)), location(loc)
+    : QueryJob(query, std::move(projects), Cacheable), location(loc)
 {
 }
 
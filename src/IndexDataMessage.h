@@ -29,11 +29,11 @@ public:
     enum { MessageId = IndexDataMessageId };
 
     IndexDataMessage(const std::shared_ptr<IndexerJob> &job)
-        : RTagsMessage(MessageId), mParseTime(0), mId(0), mIndexerJobFlags(job->flags), mBytesWritten(0)
+        : RTagsMessage(MessageId), mParseTime(0), mId(0), mIndexerJobFlags(job->flags), mBytesWritten(0), mPeakMemory(0)
     {}
 
     IndexDataMessage()
-        : RTagsMessage(MessageId), mParseTime(0), mId(0), mBytesWritten(0)
+        : RTagsMessage(MessageId), mParseTime(0), mId(0), mBytesWritten(0), mPeakMemory(0)
     {}
 
     void encode(Serializer &serializer) const override;
@@ -90,6 +90,10 @@ public:
     FixIts &fixIts() { return mFixIts; }
     Diagnostics &diagnostics() { return mDiagnostics; }
     Includes &includes() { return mIncludes; }
+    // headers included at the very top of the source file, in order
+    List<uint32_t> &includePrefix() { return mIncludePrefix; }
+    const List<uint32_t> &includePrefix() const { return mIncludePrefix; }
+    HierarchyEdges &hierarchy() { return mHierarchy; }
     enum FileFlag {
         NoFileFlag = 0x0,
         Visited = 0x1
@@ -100,6 +104,16 @@ public:
     size_t bytesWritten() const { return mBytesWritten; }
     void setBytesWritten(size_t bytes) { mBytesWritten = bytes; }
 
+    // peak resident set size of rp in bytes
+    uint64_t peakMemory() const { return mPeakMemory; }
+    void setPeakMemory(uint64_t bytes) { mPeakMemory = bytes; }
+
+    IndexProfile &profile() { return mProfile; }
+    const IndexProfile &profile() const { return mProfile; }
+
+    Hash<uint32_t, FileContent> &fileContents() { return mFileContents; }
+    const Hash<uint32_t, FileContent> &fileContents() const { return mFileContents; }
+
     void clear()
     {
         clearCache();
@@ -111,9 +125,14 @@ public:
         mFixIts.clear();
         mDiagnostics.clear();
         mIncludes.clear();
+        mIncludePrefix.clear();
+        mHierarchy.clear();
         mFiles.clear();
         mFlags.clear();
         mBytesWritten = 0;
+        mPeakMemory = 0;
+        mProfile = IndexProfile();
+        mFileContents.clear();
     }
 private:
     Path mProject;
@@ -123,9 +142,14 @@ private:
     FixIts mFixIts;
     Diagnostics mDiagnostics;
     Includes mIncludes;
+    List<uint32_t> mIncludePrefix;
+    HierarchyEdges mHierarchy;
     Hash<uint32_t, Flags<FileFlag>> mFiles;
     Flags<Flag> mFlags;
     size_t mBytesWritten;
+    uint64_t mPeakMemory;
+    IndexProfile mProfile;
+    Hash<uint32_t, FileContent> mFileContents;
 };
 
 RCT_FLAGS(IndexDataMessage::Flag);
@@ -134,13 +158,15 @@ RCT_FLAGS(IndexDataMessage::FileFlag);
 inline void IndexDataMessage::encode(Serializer &serializer) const
 {
     serializer << mProject << mParseTime << mId << mIndexerJobFlags << mMessage
-               << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags << mBytesWritten;
+               << mFixIts << mIncludes << mIncludePrefix << mHierarchy << mDiagnostics << mFiles << mFlags << mBytesWritten
+               << mProfile << mFileContents << mPeakMemory;
 }
 
 inline void IndexDataMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mProject >> mParseTime >> mId >> mIndexerJobFlags >> mMessage
-                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten;
+                 >> mFixIts >> mIncludes >> mIncludePrefix >> mHierarchy >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten
+                 >> mProfile >> mFileContents >> mPeakMemory;
 }
 
 #endif
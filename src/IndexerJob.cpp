@@ -80,6 +80,8 @@ int IndexerJob::priority() const
         } else if (flags & Reindex) {
             ret += 4;
         }
+        if (flags & Representative)
+            ret += 4;
         switch (server->activeBufferType(fileId)) {
         case Server::Active:
             ret += 8;
@@ -113,6 +115,40 @@ int IndexerJob::priority() const
     return mCachedPriority;
 }
 
+void IndexerJob::prepareSource(Source &source, const std::shared_ptr<Project> &project)
+{
+    const Server::Options &options = Server::instance()->options();
+    if (!(options.options & Server::AllowWErrorAndWFatalErrors)) {
+        int idx = source.arguments.indexOf("-Werror");
+        if (idx != -1)
+            source.arguments.removeAt(idx);
+        idx = source.arguments.indexOf("-Wfatal-errors");
+        if (idx != -1)
+            source.arguments.removeAt(idx);
+    }
+    source.arguments << options.defaultArguments;
+
+    if (!(options.options & Server::AllowPedantic)) {
+        const int idx = source.arguments.indexOf("-Wpedantic");
+        if (idx != -1) {
+            source.arguments.removeAt(idx);
+        }
+    }
+
+    if (options.options & Server::EnableCompilerManager) {
+        CompilerManager::applyToSource(source, CompilerManager::IncludeIncludePaths);
+    }
+
+    Server::instance()->filterBlockedArguments(source);
+    source.includePaths.insert(source.includePaths.begin(), options.includePaths.begin(), options.includePaths.end());
+    project->fixPCH(source);
+
+    source.defines << options.defines;
+    if (!(options.options & Server::EnableNDEBUG)) {
+        source.defines.remove(Source::Define("NDEBUG"));
+    }
+}
+
 String IndexerJob::encode() const
 {
     String ret;
@@ -129,35 +165,10 @@ String IndexerJob::encode() const
                    << project->compileCommandsFileId()
                    << static_cast<uint32_t>(sources.size());
         for (Source copy : sources) {
-            if (!(options.options & Server::AllowWErrorAndWFatalErrors)) {
-                int idx = copy.arguments.indexOf("-Werror");
-                if (idx != -1)
-                    copy.arguments.removeAt(idx);
-                idx = copy.arguments.indexOf("-Wfatal-errors");
-                if (idx != -1)
-                    copy.arguments.removeAt(idx);
-            }
-            copy.arguments << options.defaultArguments;
-
-            if (!(options.options & Server::AllowPedantic)) {
-                const int idx = copy.arguments.indexOf("-Wpedantic");
-                if (idx != -1) {
-                    copy.arguments.removeAt(idx);
-                }
-            }
-
-            if (options.options & Server::EnableCompilerManager) {
-                CompilerManager::applyToSource(copy, CompilerManager::IncludeIncludePaths);
-            }
-
-            Server::instance()->filterBlockedArguments(copy);
-            copy.includePaths.insert(copy.includePaths.begin(), options.includePaths.begin(), options.includePaths.end());
-            project->fixPCH(copy);
-
-            copy.defines << options.defines;
-            if (!(options.options & Server::EnableNDEBUG)) {
-                copy.defines.remove(Source::Define("NDEBUG"));
-            }
+            const Path preamble = project->preamble(copy);
+            prepareSource(copy, project);
+            if (!preamble.empty())
+                copy.includePaths.append(Source::Include(Source::Include::Type_PCH, preamble));
             assert(!sourceFile.empty());
             copy.encode(serializer, Source::IgnoreSandbox);
         }
@@ -174,7 +185,7 @@ String IndexerJob::encode() const
                    << options.dataDir
                    << options.debugLocations;
 
-        project->encodeVisitedFiles(serializer);
+        project->encodeVisitedFiles(serializer, visited);
     }
     const uint32_t size = ret.size() - sizeof(int);
     memcpy(&ret[0], &size, sizeof(size));
@@ -205,6 +216,9 @@ String IndexerJob::dumpFlags(Flags<Flag> flags)
     if (flags & Complete) {
         ret += "Complete";
     }
+    if (flags & Representative) {
+        ret += "Representative";
+    }
 
     return String::join(ret, ", ");
 }
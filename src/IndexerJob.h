@@ -47,6 +47,7 @@ public:
         NoAbort = 0x100,
         EditorOpen = 0x200, // opened in editor, the values of these are significant, EditorActive must be more than EditorOpen
         EditorActive = 0x400, // visible in editor
+        Representative = 0x800, // indexes a modified header ahead of the header's other dependents
         Type_Mask = Dirty|Compile|Reindex
     };
 
@@ -60,6 +61,8 @@ public:
 
     void acquireId();
     String encode() const;
+    // applies the server's argument, include path and define options the way rp sees them
+    static void prepareSource(Source &source, const std::shared_ptr<Project> &project);
 
     uint32_t sourceFileId() const { assert(!sources.empty()); return sources.begin()->fileId; }
 
@@ -73,6 +76,8 @@ public:
     std::shared_ptr<Project> project;
     UnsavedFiles unsavedFiles;
     Set<uint32_t> visited;
+    // headers handed to a Representative job before rp asked for them
+    Set<uint32_t> reserved;
     int crashCount;
     Signal<std::function<void(IndexerJob *)>> destroyed;
 
@@ -16,6 +16,8 @@
 #include "JobScheduler.h"
 
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <algorithm>
 #include <cstdint>
 #include <functional>
@@ -37,18 +39,23 @@
 #include "rct/Path.h"
 #include "rct/Rct.h"
 #include "rct/SignalSlot.h"
+#include "rct/ThreadPool.h"
 #include "rct/Timer.h"
 
 enum { MaxPriority = 10 };
+enum { AdaptiveSampleInterval = 1000 };
 // we set the priority to be this when a job has been requested and we couldn't load it
 JobScheduler::JobScheduler()
-    : mProcrastination(0), mStopped(false)
+    : mProcrastination(0), mStopped(false), mPendingUnsorted(false), mSampleTimer(-1),
+      mJobLimit(0), mMemoryBudget(UINT64_MAX), mJobMemoryTotal(0)
 {
 }
 
 JobScheduler::~JobScheduler()
 {
     mStopped = true;
+    if (mSampleTimer >= 0)
+        EventLoop::eventLoop()->unregisterTimer(mSampleTimer);
     mPendingJobs.deleteAll();
     for (const auto &job : mActiveByProcess) {
         mDaemons.erase(job.first);
@@ -64,9 +71,111 @@ JobScheduler::~JobScheduler()
 
 bool JobScheduler::start()
 {
+    const auto &options = Server::instance()->options();
+    mJobLimit = options.jobCount;
+    if (options.options & Server::AdaptiveJobCount)
+        mSampleTimer = EventLoop::eventLoop()->registerTimer([this](int) { sample(); }, AdaptiveSampleInterval);
     return initDaemons();
 }
 
+size_t JobScheduler::jobLimit() const
+{
+    const auto &options = Server::instance()->options();
+    if (!(options.options & Server::AdaptiveJobCount))
+        return options.jobCount;
+    return std::min(mJobLimit, options.jobCount);
+}
+
+static String readProcFile(const char *path)
+{
+    // can't go by the file size for files in /proc
+    String ret;
+    if (FILE *f = fopen(path, "r")) {
+        char buf[1024];
+        size_t r;
+        while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
+            ret.append(buf, r);
+        fclose(f);
+    }
+    return ret;
+}
+
+// avg10 of the "some" or "full" line of a /proc/pressure file, -1 without PSI
+static double pressure(const String &contents, const char *line)
+{
+    const String key = String::format<32>("%s avg10=", line);
+    const size_t idx = contents.indexOf(key);
+    if (idx == String::npos)
+        return -1;
+    return strtod(contents.constData() + idx + key.size(), nullptr);
+}
+
+// a field of /proc/meminfo in bytes, 0 if it isn't there
+static uint64_t memInfo(const String &contents, const char *field)
+{
+    const String key = String::format<32>("\n%s:", field);
+    const size_t idx = contents.indexOf(key);
+    if (idx == String::npos)
+        return 0;
+    return strtoull(contents.constData() + idx + key.size(), nullptr, 10) * 1024;
+}
+
+void JobScheduler::sample()
+{
+    const size_t active = mActiveByProcess.size();
+    if (!active && mPendingJobs.empty())
+        return;
+
+    const auto &options = Server::instance()->options();
+    const size_t maxJobs = options.jobCount;
+    const size_t minJobs = std::min(options.minJobCount, maxJobs);
+    const String memory = readProcFile("/proc/pressure/memory");
+    const String cpu = readProcFile("/proc/pressure/cpu");
+    String meminfo = "\n";
+    meminfo += readProcFile("/proc/meminfo");
+    const uint64_t memTotal = memInfo(meminfo, "MemTotal");
+    const uint64_t memAvailable = memInfo(meminfo, "MemAvailable");
+    mMemoryBudget = memAvailable ? memAvailable - std::min(memAvailable, memTotal / 10) : UINT64_MAX;
+
+    bool memoryPressure = pressure(memory, "some") > 10 || pressure(memory, "full") > 1;
+    if (memTotal && memAvailable && memAvailable < memTotal / 10)
+        memoryPressure = true;
+    double cpuPressure = pressure(cpu, "some");
+    bool cpuBusy;
+    if (cpuPressure >= 0) {
+        cpuBusy = cpuPressure > 50;
+    } else {
+        double load;
+        cpuBusy = getloadavg(&load, 1) == 1 && load > std::max(ThreadPool::idealThreadCount(), 1) * 1.5;
+    }
+
+    const size_t old = mJobLimit;
+    if (memoryPressure) {
+        // back off below what's running now, then wait for jobs to finish
+        // since pressure is averaged over ten seconds
+        if (active && mJobLimit >= active)
+            mJobLimit = active > minJobs ? active - 1 : minJobs;
+    } else if (!cpuBusy && mJobLimit < maxJobs && !mPendingJobs.empty() && active >= mJobLimit) {
+        ++mJobLimit;
+    }
+    mJobLimit = std::max(minJobs, std::min(mJobLimit, maxJobs));
+    if (mJobLimit != old) {
+        debug() << "Adjusting job limit from" << old << "to" << mJobLimit
+                << "memory pressure" << memoryPressure << "cpu busy" << cpuBusy
+                << "available" << (memAvailable / (1024 * 1024)) << "mb";
+    }
+    if (mJobLimit > old)
+        startJobs();
+}
+
+uint64_t JobScheduler::expectedMemory(uint32_t sourceFileId) const
+{
+    const uint64_t ret = mJobMemory.value(sourceFileId);
+    if (ret || mJobMemory.empty())
+        return ret;
+    return mJobMemoryTotal / mJobMemory.size();
+}
+
 bool JobScheduler::initDaemons()
 {
     const auto &options = Server::instance()->options();
@@ -97,12 +206,17 @@ void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
     assert(!(job->flags & (IndexerJob::Crashed|IndexerJob::Aborted|IndexerJob::Complete|IndexerJob::Running)));
     std::shared_ptr<Node> node(new Node);
     node->job = job;
+    if (job->project)
+        node->cost = job->project->jobCost(job->sourceFileId());
     // error() << job->priority << job->sourceFile << mProcrastination;
-    if (mPendingJobs.empty() || job->priority() > mPendingJobs.front()->job->priority()) {
+    if (mProcrastination) {
+        mPendingJobs.push_back(node);
+        mPendingUnsorted = true;
+    } else if (mPendingJobs.empty() || runsBefore(node, mPendingJobs.front())) {
         mPendingJobs.prepend(node);
     } else {
         std::shared_ptr<Node> after = mPendingJobs.back();
-        while (job->priority() > after->job->priority()) {
+        while (runsBefore(node, after)) {
             after = after->prev;
             assert(after);
         }
@@ -119,12 +233,15 @@ void JobScheduler::startJobs()
 {
     Server *server = Server::instance();
     assert(server);
+    if (mPendingUnsorted)
+        sortPending();
     if (server->suspended()) {
         warning() << "Suspended, not starting jobs";
         return;
     }
     const auto &options = server->options();
-    int slots = std::max<int>(0, options.jobCount - mActiveByProcess.size());
+    const bool adaptive = options.options & Server::AdaptiveJobCount;
+    int slots = std::max<int>(0, jobLimit() - mActiveByProcess.size());
     int daemonSlots = std::max<int>(0, options.daemonCount - mActiveDaemonsByProcess.size());
 
     debug() << "JobScheduler::startJobs" << "jobCount" << options.jobCount << "active" << mActiveByProcess.size() << "\n"
@@ -186,6 +303,16 @@ void JobScheduler::startJobs()
                 continue;
             }
         }
+        if (slots && adaptive && !mActiveByProcess.empty()) {
+            // don't start jobs we don't expect to have room for, smaller
+            // ones further down might fit
+            const uint64_t expected = expectedMemory(node->job->sourceFileId());
+            if (expected > mMemoryBudget) {
+                node = node->next;
+                continue;
+            }
+            mMemoryBudget -= expected;
+        }
         if (slots) {
             Process *process = new Process;
             debug() << "Starting process for" << node->job->id << node->job->sourceFile << node->job.get();
@@ -245,6 +372,14 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
         return;
     }
     debug() << "job got index data message" << node->job->id << node->job->sourceFileId() << node->job.get();
+    if (node->job->project && !(message->flags() & IndexDataMessage::ParseFailure))
+        node->job->project->updateJobCost(node->job->sourceFileId(), Rct::monoMs() - node->started);
+    if (!node->daemon && message->peakMemory()) {
+        // daemons keep translation units around so their rss says little about the job
+        uint64_t &memory = mJobMemory[node->job->sourceFileId()];
+        mJobMemoryTotal += message->peakMemory() - memory;
+        memory = message->peakMemory();
+    }
     jobFinished(node->job, message);
 }
 
@@ -285,15 +420,22 @@ void JobScheduler::dumpJobs(const std::shared_ptr<Connection> &conn)
     conn->write<1024>("Pending: %zu", mPendingJobs.size());
     if (!mPendingJobs.empty()) {
         for (const auto &node : mPendingJobs) {
-            conn->write<128>("%s: %s %d %s",
+            conn->write<128>("%s: %s %d %s cost: %llums",
                              node->job->sourceFile.constData(),
                              node->job->flags.toString().constData(),
                              node->job->priority(),
-                             IndexerJob::dumpFlags(node->job->flags).constData());
+                             IndexerJob::dumpFlags(node->job->flags).constData(),
+                             static_cast<unsigned long long>(node->cost));
         }
     }
 
-    conn->write<1024>("Active: %zu/%zu", mActiveById.size(), Server::instance()->options().jobCount);
+    const auto &options = Server::instance()->options();
+    if (options.options & Server::AdaptiveJobCount) {
+        conn->write<1024>("Active: %zu/%zu (adaptive %zu-%zu)", mActiveById.size(), jobLimit(),
+                          std::min(options.minJobCount, options.jobCount), options.jobCount);
+    } else {
+        conn->write<1024>("Active: %zu/%zu", mActiveById.size(), options.jobCount);
+    }
     if (!mActiveById.empty()) {
         const unsigned long long now = Rct::monoMs();
         for (const auto &node : mActiveById) {
@@ -357,18 +499,32 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
     }
 }
 
+// Within a priority the most expensive jobs go first so a big reindex
+// doesn't end with one slow translation unit running on its own.
+bool JobScheduler::runsBefore(const std::shared_ptr<Node> &l, const std::shared_ptr<Node> &r)
+{
+    const int lp = l->job->priority();
+    const int rp = r->job->priority();
+    if (lp != rp)
+        return lp > rp;
+    return l->cost > r->cost;
+}
+
 void JobScheduler::sort()
 {
-    std::vector<std::shared_ptr<Node>> nodes(mPendingJobs.size());
-    for (size_t i=0; i<nodes.size(); ++i) {
-        std::shared_ptr<Node> node = mPendingJobs.removeFirst();
+    for (const auto &node : mPendingJobs)
         node->job->recalculatePriority();
-        nodes[i] = std::move(node);
-    }
+    sortPending();
+}
+
+void JobScheduler::sortPending()
+{
+    mPendingUnsorted = false;
+    std::vector<std::shared_ptr<Node>> nodes(mPendingJobs.size());
+    for (size_t i=0; i<nodes.size(); ++i)
+        nodes[i] = mPendingJobs.removeFirst();
 
-    std::stable_sort(nodes.begin(), nodes.end(), [](const std::shared_ptr<Node> &l, const std::shared_ptr<Node> &r) -> bool {
-        return l->job->priority() > r->job->priority();
-    });
+    std::stable_sort(nodes.begin(), nodes.end(), runsBefore);
 
     for (std::shared_ptr<Node> &n : nodes) {
         mPendingJobs.push_back(std::move(n));
@@ -69,16 +69,24 @@ public:
     void startJobs();
     size_t pendingJobCount() const { return mPendingJobs.size(); }
     size_t activeJobCount() const { return mActiveById.size(); }
+    // how many jobs we may run right now, with --adaptive-job-count this
+    // moves between the configured bounds
+    size_t jobLimit() const;
     void sort();
 private:
+    void sample();
+    uint64_t expectedMemory(uint32_t sourceFileId) const;
     bool initDaemons();
     void onProcessReadyReadStdErr(Process *process);
     void onProcessReadyReadStdOut(Process *process);
     void onProcessFinished(Process *process, pid_t pid);
     void connectProcess(Process *process);
     void jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message);
+    void sortPending();
     struct Node {
         unsigned long long started { 0 };
+        // how long the last jobs for this source took, in ms
+        uint64_t cost { 0 };
         std::shared_ptr<IndexerJob> job;
         Process *process { nullptr };
         std::shared_ptr<Node> next, prev;
@@ -86,8 +94,20 @@ private:
         bool daemon { false };
     };
 
+    static bool runsBefore(const std::shared_ptr<Node> &l, const std::shared_ptr<Node> &r);
+
     int mProcrastination;
     bool mStopped;
+    // jobs added inside a JobScope are sorted once when it ends
+    bool mPendingUnsorted;
+    int mSampleTimer;
+    size_t mJobLimit;
+    // bytes available at the last sample minus what the jobs started since
+    // then are expected to use
+    uint64_t mMemoryBudget;
+    // peak rss of the last job for each source
+    Hash<uint32_t, uint64_t> mJobMemory;
+    uint64_t mJobMemoryTotal;
     struct DaemonData {
         uint64_t touched { 0 };
         SourceList cache;
@@ -0,0 +1,84 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "PreambleThread.h"
+
+#include <stdio.h>
+
+#include "Project.h"
+#include "RTags.h"
+#include "Server.h"
+#include "clang-c/Index.h"
+#include "rct/EventLoop.h"
+#include "rct/Log.h"
+#include "rct/Rct.h"
+#include "rct/StopWatch.h"
+
+PreambleThread::PreambleThread(const std::shared_ptr<Project> &project,
+                               const String &key,
+                               const Path &header,
+                               const List<Path> &includes,
+                               const List<String> &arguments)
+    : Thread(), mProject(project), mKey(key), mHeader(header), mIncludes(includes), mArguments(arguments)
+{
+    setAutoDelete(true);
+}
+
+void PreambleThread::run()
+{
+    const uint64_t started = Rct::currentTimeMs();
+    StopWatch sw;
+    bool ok = false;
+    Path::mkdir(mHeader.parentDir(), Path::Recursive);
+    if (FILE *f = fopen(mHeader.constData(), "w")) {
+        for (const Path &include : mIncludes)
+            fprintf(f, "#include \"%s\"\n", include.constData());
+        fclose(f);
+
+        Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_DetailedPreprocessingRecord;
+        flags |= CXTranslationUnit_Incomplete;
+        std::shared_ptr<RTags::TranslationUnit> unit = RTags::TranslationUnit::create(mHeader, mArguments, nullptr, 0, flags,
+                                                                                      Server::instance()->options().options & Server::NoNoStdInc
+                                                                                      ? RTags::TranslationUnit::NoNoStdInc
+                                                                                      : RTags::TranslationUnit::None);
+        if (unit->unit) {
+            ok = true;
+            const unsigned int count = clang_getNumDiagnostics(unit->unit);
+            for (unsigned int i=0; ok && i<count; ++i) {
+                CXDiagnostic diagnostic = clang_getDiagnostic(unit->unit, i);
+                if (clang_getDiagnosticSeverity(diagnostic) >= CXDiagnostic_Error)
+                    ok = false;
+                clang_disposeDiagnostic(diagnostic);
+            }
+            if (ok) {
+                const Path pch = mHeader + ".gch";
+                const Path tmp = pch + ".tmp";
+                ok = clang_saveTranslationUnit(unit->unit, tmp.constData(), clang_defaultSaveOptions(unit->unit)) == CXSaveError_None
+                    && !rename(tmp.constData(), pch.constData());
+            }
+        }
+        warning() << "Built preamble" << mHeader << "with" << mIncludes.size() << "headers in" << sw.elapsed() << "ms" << (ok ? "" : "(failed)")
+                  << unit->clangLine;
+    } else {
+        error() << "Failed to write preamble" << mHeader;
+    }
+
+    std::weak_ptr<Project> project = mProject;
+    const String key = mKey;
+    EventLoop::mainEventLoop()->callLater([project, key, ok, started]() {
+        if (std::shared_ptr<Project> p = project.lock())
+            p->onPreambleFinished(key, ok, started);
+    });
+}
@@ -0,0 +1,49 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef PreambleThread_h
+#define PreambleThread_h
+
+#include <stdint.h>
+#include <memory>
+
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+#include "rct/Thread.h"
+
+class Project;
+
+// Builds a PCH for a run of headers that many sources in a project start
+// with. The result is written to <header>.gch and handed back to the
+// project on the main thread.
+class PreambleThread : public Thread
+{
+public:
+    PreambleThread(const std::shared_ptr<Project> &project,
+                   const String &key,
+                   const Path &header,
+                   const List<Path> &includes,
+                   const List<String> &arguments);
+    virtual void run() override;
+private:
+    const std::weak_ptr<Project> mProject;
+    const String mKey;
+    const Path mHeader;
+    const List<Path> mIncludes;
+    const List<String> mArguments;
+};
+
+#endif
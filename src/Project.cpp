@@ -25,10 +25,12 @@
 #include <regex>
 #include <utility>
 #include <algorithm>
+#include <atomic>
 #include <initializer_list>
 #include <limits>
 #include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 #include <variant>
 
@@ -42,6 +44,7 @@
 #include "rct/MemoryMonitor.h"
 #include "rct/Path.h"
 #include "rct/Rct.h"
+#include "rct/ThreadPool.h"
 #include "rct/Value.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
@@ -50,6 +53,7 @@
 #include "FileMap.h"
 #include "FixIt.h"
 #include "Match.h"
+#include "PreambleThread.h"
 #include "Sandbox.h"
 #include "Token.h"
 #include "clang-c/Index.h"
@@ -64,6 +68,17 @@ enum
     CheckPeriodicTimeout = 60 * 60 * 1000
 };
 
+enum
+{
+    PreambleMinSources  = 4,
+    PreambleMinIncludes = 3
+};
+
+enum { MinFilesPerStatThread = 256 };
+// beyond this many modified headers (a branch switch say) there's no point in
+// picking a job to index each of them first
+enum { MaxRepresentativeHeaders = 16 };
+
 class Dirty
 {
 public:
@@ -107,6 +122,9 @@ public:
 class ComplexDirty : public Dirty
 {
 public:
+    ComplexDirty(const std::shared_ptr<Project> &project = std::shared_ptr<Project>())
+        : mProject(project)
+    {}
     virtual Set<uint32_t> dirtied() const override
     {
         return mDirty;
@@ -123,8 +141,26 @@ public:
         }
         return time;
     }
+    // whether fileId changed since a source that depends on it was parsed,
+    // files that were only touched don't count
+    bool isModified(uint32_t fileId, uint64_t parsed)
+    {
+        const uint64_t time = lastModified(fileId);
+        if (!time)
+            return true;
+        if (time <= parsed)
+            return false;
+        if (!mProject || mProject->contentIndexed(fileId) > parsed)
+            return true;
+        auto it = mContentChanged.find(fileId);
+        if (it == mContentChanged.end())
+            it = mContentChanged.insert(std::make_pair(fileId, mProject->contentChanged(fileId, time))).first;
+        return it->second;
+    }
 
+    std::shared_ptr<Project> mProject;
     Hash<uint32_t, uint64_t> mLastModified;
+    Hash<uint32_t, bool> mContentChanged;
     Set<uint32_t> mDirty;
 };
 
@@ -141,37 +177,148 @@ class IfModifiedDirty : public ComplexDirty
 {
 public:
     IfModifiedDirty(const std::shared_ptr<Project> &project, const Match &match = Match())
-        : mProject(project), mMatch(match)
+        : ComplexDirty(project), mMatch(match)
     {
     }
 
     virtual bool isDirty(const SourceList &sourceList) override
     {
+        const uint32_t fileId = sourceList.fileId();
+        if (!mMatch.empty() && !mMatch.match(Location::path(fileId)))
+            return false;
+
+        if (!mInitialized) {
+            mInitialized = true;
+            statFiles();
+            computeClosures();
+        }
+
+        auto closure = mClosureModified.find(fileId);
+        const uint64_t modified = closure != mClosureModified.end() ? closure->second : modifiedOrMax(fileId);
+        if (modified <= sourceList.parsed)
+            return false;
+
+        // Only the sources that might be dirty have their closure walked to
+        // find the files that changed.
         bool ret = false;
+        for (auto it : mProject->dependencies(fileId, Project::ArgDependsOn)) {
+            if (isModified(it, sourceList.parsed)) {
+                ret = true;
+                insertDirtyFile(it);
+            }
+        }
+        if (ret)
+            mDirty.insert(fileId);
+        return ret;
+    }
 
-        const uint32_t fileId = sourceList.fileId();
-        if (mMatch.empty() || mMatch.match(Location::path(fileId))) {
-            for (auto it : mProject->dependencies(fileId, Project::ArgDependsOn)) {
-                uint64_t depLastModified = lastModified(it);
-                if (!depLastModified || depLastModified > sourceList.parsed) {
-                    ret = true;
-                    if (insertDirtyFile(it)) {
-                        // error() << "dude is dirty" << Location::path(fileId)
-                        //         << sourceList.size()
-                        //         << depLastModified << sourceList.parsed;
+    Match mMatch;
+private:
+    // missing files are always newer than anything
+    uint64_t modifiedOrMax(uint32_t fileId)
+    {
+        const uint64_t ret = lastModified(fileId);
+        return ret ? ret : std::numeric_limits<uint64_t>::max();
+    }
+
+    void statFiles()
+    {
+        const Dependencies &deps = mProject->dependencies();
+        List<std::pair<uint32_t, Path>> files;
+        files.reserve(deps.size());
+        for (const auto &dep : deps)
+            files.append(std::make_pair(dep.first, Location::path(dep.first)));
+        List<uint64_t> times(files.size());
+        const size_t threadCount = std::min<size_t>(std::max(ThreadPool::idealThreadCount(), 1),
+                                                    files.size() / MinFilesPerStatThread);
+        auto stat = [&](size_t idx, size_t step) {
+            for (size_t i=idx; i<files.size(); i += step)
+                times[i] = files.at(i).second.lastModifiedMs();
+        };
+        if (threadCount <= 1) {
+            stat(0, 1);
+        } else {
+            List<std::thread> threads;
+            threads.reserve(threadCount - 1);
+            for (size_t i=1; i<threadCount; ++i)
+                threads.emplace_back(stat, i, threadCount);
+            stat(0, threadCount);
+            for (std::thread &thread : threads)
+                thread.join();
+        }
+        for (size_t i=0; i<files.size(); ++i) {
+            if (times.at(i))
+                mLastModified[files.at(i).first] = times.at(i);
+        }
+    }
+
+    // Newest mtime in the include closure of every file, in one pass over
+    // the include graph. Includes can be cyclic so this is Tarjan's strongly
+    // connected components, every file in a component shares its closure.
+    void computeClosures()
+    {
+        struct NodeState {
+            uint32_t index, lowLink;
+            uint64_t modified;
+            bool onStack;
+        };
+        struct Frame {
+            DependencyNode *node;
+            Dependencies::const_iterator child;
+        };
+        Hash<DependencyNode *, NodeState> states;
+        List<DependencyNode *> stack;
+        List<Frame> frames;
+        uint32_t counter = 0;
+        auto push = [&](DependencyNode *node) {
+            states[node] = { counter, counter, modifiedOrMax(node->fileId), true };
+            ++counter;
+            stack.append(node);
+            frames.append({ node, node->includes.begin() });
+        };
+
+        for (const auto &root : mProject->dependencies()) {
+            if (states.contains(root.second))
+                continue;
+            push(root.second);
+            while (!frames.empty()) {
+                DependencyNode *node = frames.back().node;
+                NodeState &state = states[node];
+                if (frames.back().child != node->includes.end()) {
+                    DependencyNode *child = (frames.back().child++)->second;
+                    auto it = states.find(child);
+                    if (it == states.end()) {
+                        push(child);
+                    } else if (it->second.onStack) {
+                        state.lowLink = std::min(state.lowLink, it->second.index);
+                    } else {
+                        state.modified = std::max(state.modified, it->second.modified);
                     }
+                    continue;
+                }
+                frames.removeLast();
+                if (!frames.empty()) {
+                    NodeState &parent = states[frames.back().node];
+                    parent.lowLink = std::min(parent.lowLink, state.lowLink);
+                    parent.modified = std::max(parent.modified, state.modified);
+                }
+                if (state.lowLink == state.index) {
+                    DependencyNode *member;
+                    do {
+                        member = stack.back();
+                        stack.removeLast();
+                        NodeState &memberState = states[member];
+                        memberState.onStack = false;
+                        memberState.modified = state.modified;
+                        mClosureModified[member->fileId] = state.modified;
+                    } while (member != node);
                 }
             }
-            if (ret)
-                mDirty.insert(fileId);
-
-            assert(!ret || mDirty.contains(fileId));
         }
-        return ret;
     }
 
-    std::shared_ptr<Project> mProject;
-    Match mMatch;
+    Hash<uint32_t, uint64_t> mClosureModified;
+    bool mInitialized { false };
 };
 
 
@@ -179,6 +326,7 @@ class WatcherDirty : public ComplexDirty
 {
 public:
     WatcherDirty(const std::shared_ptr<Project> &project, const Set<uint32_t> &modified)
+        : ComplexDirty(project)
     {
         for (auto it : modified) {
             mModified[it] = project->dependencies(it, Project::DependsOnArg);
@@ -192,9 +340,7 @@ public:
         for (auto it : mModified) {
             const auto &deps = it.second;
             if (deps.contains(sourceList.fileId())) {
-                const uint64_t depLastModified = lastModified(it.first);
-                if (!depLastModified || depLastModified > sourceList.parsed) {
-                    // dependency is gone
+                if (isModified(it.first, sourceList.parsed)) {
                     ret = true;
                     insertDirtyFile(it.first);
                 }
@@ -282,6 +428,12 @@ static void saveDependencies(DataFile &file, const Dependencies &dependencies)
     }
 }
 
+uint64_t Project::nextGeneration()
+{
+    static std::atomic<uint64_t> sGeneration(0);
+    return ++sGeneration;
+}
+
 Project::~Project()
 {
     if (mSaveDirty)
@@ -401,6 +553,16 @@ bool Project::init(const Path &srcPath, uint32_t compileCommandsFileId)
         file >> mVisitedFiles;
     }
     file >> mDiagnostics;
+    for (const auto &diagnostic : mDiagnostics)
+        mDiagnosticsBySource[diagnostic.second.sourceFileId].insert(diagnostic.first);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        file >> mHierarchy;
+        for (const auto &edges : mHierarchy) {
+            for (const HierarchyEdge &edge : edges.second)
+                addHierarchyEdge(edge);
+        }
+    }
     if (mIndexParseData.compileCommandsFileId) {
         watch(Location::path(mIndexParseData.compileCommandsFileId).parentDir(), Watch_CompileCommands);
     }
@@ -409,11 +571,19 @@ bool Project::init(const Path &srcPath, uint32_t compileCommandsFileId)
         mDependencies.deleteAll();
         mVisitedFiles.clear();
         mDiagnostics.clear();
+        mDiagnosticsBySource.clear();
+        mHierarchy.clear();
+        mDerived.clear();
+        mBases.clear();
         error("Restore error %s: Failed to load dependencies.", mPath.constData());
         reindexAll();
         return true;
     }
 
+    file >> mFileContents >> mJobCosts;
+    for (const auto &cost : mJobCosts)
+        mJobCostTotal += cost.second;
+
     for (const auto &dep : mDependencies) {
         watchFile(dep.first);
     }
@@ -598,8 +768,6 @@ inline static const char *severityToString(Diagnostic::Flag type)
 
 static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessage::Flag> flags, Set<uint32_t> &&filter = Set<uint32_t>())
 {
-    Diagnostics::const_iterator it;
-    Diagnostics::const_iterator end;
     {
         if (Server::instance()->activeBuffersSet()) {
             Set<uint32_t> active = Server::instance()->activeBuffers(Server::Active);
@@ -615,26 +783,17 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
 
     const size_t filterSize = filter.size();
 
-    // bool debug = false;
-    switch (filterSize) {
-    case 0:
-        it = diagnostics.begin();
-        end = diagnostics.end();
-        break;
-    case 1: {
-        uint32_t fileId = *filter.begin();
-        it = diagnostics.lower_bound(Location(fileId, 0, 0));
-        end = diagnostics.lower_bound(Location(fileId + 1, 0, 0));
-        // debug = (Location::path(fileId) == "/home/abakken/temp/compl1/main.cpp");
-        // error() << "THESE ARE THE ITERATORS" << (it == diagnostics.end() ? "end" : it->first.toString().constData())
-        //         << (end == diagnostics.end() ? "end" : end->first.toString().constData()) << diagnostics.keys();
-        break; }
-    default: {
-        it = diagnostics.lower_bound(Location(*filter.begin(), 0, 0));
-        auto e = filter.end();
-        --e;
-        end = diagnostics.lower_bound(Location(*e, 0, 0));
-        break; }
+    // one range per file in the filter so we don't walk the diagnostics of
+    // every file in between
+    List<std::pair<Diagnostics::const_iterator, Diagnostics::const_iterator>> ranges;
+    if (!filterSize) {
+        ranges.append(std::make_pair(diagnostics.begin(), diagnostics.end()));
+    } else {
+        ranges.reserve(filterSize);
+        for (uint32_t fileId : filter) {
+            ranges.append(std::make_pair(diagnostics.lower_bound(Location(fileId, 0, 0)),
+                                         diagnostics.lower_bound(Location(fileId + 1, 0, 0))));
+        }
     }
 
     if (flags & QueryMessage::JSON) {
@@ -664,26 +823,20 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
         checkStyle = Value(Value::Type_Map);
         Value *currentFile = nullptr;
         uint32_t lastFileId = 0;
-        uint32_t ignoredFileId = 0;
-        while (it != end) {
-            const auto &ref = it++;
-            const uint32_t f = ref->first.fileId();
-            if (f == ignoredFileId) {
-                continue;
-            }
-            if (!(flags & QueryMessage::JSONDiagnosticsIncludeSkipped) && ref->second.type() == Diagnostic::Skipped) {
-                continue;
-            }
-            if (f != lastFileId) {
-                if (filterSize && !filter.remove(f)) {
-                    ignoredFileId = f;
+        for (const auto &range : ranges) {
+            for (auto ref = range.first; ref != range.second; ++ref) {
+                const uint32_t f = ref->first.fileId();
+                if (!(flags & QueryMessage::JSONDiagnosticsIncludeSkipped) && ref->second.type() == Diagnostic::Skipped) {
                     continue;
                 }
-
-                currentFile = &checkStyle[ref->first.path()];
-                lastFileId = f;
+                if (f != lastFileId) {
+                    if (filterSize)
+                        filter.remove(f);
+                    currentFile = &checkStyle[ref->first.path()];
+                    lastFileId = f;
+                }
+                currentFile->push_back(toValue(lastFileId, ref->first, ref->second));
             }
-            currentFile->push_back(toValue(lastFileId, ref->first, ref->second));
         }
         for (uint32_t f : filter) {
             checkStyle[Location::path(f)] = Value(Value::Type_List);
@@ -771,31 +924,26 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
     }
     String ret;
     uint32_t lastFileId = 0;
-    uint32_t ignoredFileId = 0;
     bool first = true;
-    while (it != end) {
-        const auto &entry = *it++;
-        Location loc = entry.first;
-        const uint32_t f = loc.fileId();
-        if (f == ignoredFileId)
-            continue;
-        if (f != lastFileId) {
-            if (filterSize && !filter.remove(f)) {
-                ignoredFileId = f;
-                continue;
-            }
+    for (const auto &range : ranges) {
+        for (auto entry = range.first; entry != range.second; ++entry) {
+            const Location loc = entry->first;
+            const uint32_t f = loc.fileId();
+            if (f != lastFileId) {
+                if (filterSize)
+                    filter.remove(f);
 
-            if (first) {
-                ret = header[format];
-                first = false;
+                if (first) {
+                    ret = header[format];
+                    first = false;
+                }
+                if (lastFileId)
+                    ret << endFile[format];
+                lastFileId = f;
+                ret << String::format<1024>(startFile[format], loc.path().constData());
             }
-            if (lastFileId)
-                ret << endFile[format];
-            lastFileId = loc.fileId();
-            ret << String::format<1024>(startFile[format], loc.path().constData());
+            ret << formatDiagnostic(loc, entry->second, lastFileId, 0);
         }
-        const Diagnostic &diagnostic = entry.second;
-        ret << formatDiagnostic(loc, diagnostic, lastFileId, 0);
     }
     if (lastFileId) {
         ret << endFile[format];
@@ -822,12 +970,31 @@ static Flags<QueryMessage::Flag> queryFlags(const std::shared_ptr<LogOutput> &ou
     return NullFlags;
 }
 
+// The output only depends on the format flags of each connection so format
+// once per format rather than once per connection.
+static void logDiagnostics(const Diagnostics &diagnostics, const Set<uint32_t> &files)
+{
+    const Flags<QueryMessage::Flag> formatFlags = QueryMessage::Elisp|QueryMessage::JSON|QueryMessage::JSONDiagnosticsIncludeSkipped;
+    Hash<unsigned long long, String> formatted;
+    log([&](const std::shared_ptr<LogOutput> &output) {
+        if (output->testLog(RTags::DiagnosticsLevel)) {
+            const Flags<QueryMessage::Flag> flags = queryFlags(output) & formatFlags;
+            auto it = formatted.find(flags.cast<unsigned long long>());
+            if (it == formatted.end())
+                it = formatted.insert(std::make_pair(flags.cast<unsigned long long>(), formatDiagnostics(diagnostics, flags, Set<uint32_t>(files)))).first;
+            if (!it->second.empty())
+                output->log(it->second);
+        }
+    });
+}
+
 void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg)
 {
     List<std::shared_ptr<Project>> projects;
     projects.append(shared_from_this());
     FileMapScopeScope scope(projects, NoValidate);
     mBytesWritten += msg->bytesWritten();
+    mIndexProfile += msg->profile();
     std::shared_ptr<IndexerJob> restart;
     const uint32_t fileId = job->sourceFileId();
     auto j = mActiveJobs.take(fileId);
@@ -839,6 +1006,22 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         return;
     }
 
+    // A representative that no longer includes a header it was handed
+    // (e.g. both changed in a checkout) never visited it. Everyone else has
+    // been told it's taken, so give it back and dirty it again once our
+    // dependencies are updated.
+    Set<uint32_t> unclaimed;
+    if (!job->reserved.empty()) {
+        const Set<uint32_t> visitedFiles = msg->visitedFiles();
+        for (uint32_t header : job->reserved) {
+            if (!visitedFiles.contains(header)) {
+                unclaimed.insert(header);
+                job->visited.remove(header);
+            }
+        }
+        releaseFileIds(unclaimed);
+    }
+
     const bool success = job->flags & IndexerJob::Complete;
     assert(!(job->flags & IndexerJob::Aborted));
     assert(((job->flags & (IndexerJob::Complete|IndexerJob::Crashed)) == IndexerJob::Complete)
@@ -883,18 +1066,41 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     }
 
     Set<uint32_t> visited = msg->visitedFiles();
+    // the includes matter too since the dependents of those files changed
+    mGeneration = nextGeneration();
+    for (uint32_t file : visited)
+        mFileGenerations[file] = mGeneration;
+    for (const auto &include : msg->includes())
+        mFileGenerations[include.second] = mGeneration;
     updateFixIts(visited, msg->fixIts());
+    updateHierarchy(visited, msg->hierarchy());
     updateDependencies(fileId, msg);
+    if (success) {
+        for (uint32_t header : unclaimed)
+            dirty(header);
+    }
+    if (success && options.options & Server::AutoPCH)
+        updatePreamble(job->sources.front(), msg);
     if (success) {
         if (mIndexParseData.sources.contains(fileId)) {
             mIndexParseData.sources[fileId].parsed = msg->parseTime();
         }
+        for (uint32_t file : visited) {
+            auto it = msg->fileContents().find(file);
+            if (it != msg->fileContents().end()) {
+                mFileContents[file] = it->second;
+            } else {
+                mFileContents.remove(file);
+            }
+        }
         logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s. (%s)",
                                                   static_cast<int>(round((double(idx) / double(mJobCounter)) * 100.0)), idx, mJobCounter,
                                                   String::formatTime(time(nullptr), String::Time).constData(),
                                                   msg->message().constData(),
                                                   String::format<16>("priority %d", job->priority()).constData()),
                   LogOutput::StdOut|LogOutput::TrailingNewLine);
+        if (options.options & Server::IndexerProfile)
+            logDirect(LogLevel::Error, msg->profile().toString(), LogOutput::StdOut|LogOutput::TrailingNewLine);
     } else {
         assert(msg->indexerJobFlags() & IndexerJob::Crashed);
         logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s indexing crashed.",
@@ -914,6 +1120,7 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
                                               static_cast<unsigned long long>(MemoryMonitor::usage() / (1024 * 1024)));
         Log(LogLevel::Error, LogOutput::StdOut|LogOutput::TrailingNewLine) << m;
         mJobsStarted = mJobCounter = 0;
+        startPreambles();
 
         // error() << "Finished this
     } else {
@@ -921,29 +1128,52 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     }
 }
 
+bool Project::contentChanged(uint32_t fileId, uint64_t lastModified)
+{
+    auto it = mFileContents.find(fileId);
+    if (it == mFileContents.end())
+        return true;
+    FileContent &content = it->second;
+    if (content.lastModified == lastModified)
+        return false;
+    const String contents = Location::path(fileId).readAll();
+    if (RTags::contentHash(contents) != content.hash)
+        return true;
+    // remember the new time so we don't hash it again
+    content.lastModified = lastModified;
+    mSaveDirty = true;
+    return false;
+}
+
+uint64_t Project::jobCost(uint32_t sourceFileId) const
+{
+    const uint64_t cost = mJobCosts.value(sourceFileId);
+    if (cost || mJobCosts.empty())
+        return cost;
+    return mJobCostTotal / mJobCosts.size();
+}
+
+void Project::updateJobCost(uint32_t sourceFileId, uint64_t ms)
+{
+    ms = std::max<uint64_t>(ms, 1);
+    uint64_t &cost = mJobCosts[sourceFileId];
+    mJobCostTotal -= cost;
+    // smooth out the odd job that was slow because the machine was busy
+    cost = cost ? (cost + ms) / 2 : ms;
+    mJobCostTotal += cost;
+}
+
 void Project::diagnose(uint32_t fileId)
 {
-    log([&](const std::shared_ptr<LogOutput> &output) {
-        if (output->testLog(RTags::DiagnosticsLevel)) {
-            Set<uint32_t> filter;
-            if (fileId)
-                filter.insert(fileId);
-            const String log = formatDiagnostics(mDiagnostics, queryFlags(output), std::move(filter));
-            if (!log.empty())
-                output->log(log);
-        }
-    });
+    Set<uint32_t> filter;
+    if (fileId)
+        filter.insert(fileId);
+    logDiagnostics(mDiagnostics, filter);
 }
 
 void Project::diagnoseAll()
 {
-    log([&](const std::shared_ptr<LogOutput> &output) {
-        if (output->testLog(RTags::DiagnosticsLevel)) {
-            const String log = formatDiagnostics(mDiagnostics, queryFlags(output));
-            if (!log.empty())
-                output->log(log);
-        }
-    });
+    logDiagnostics(mDiagnostics, Set<uint32_t>());
 }
 
 String Project::diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fileId)
@@ -980,7 +1210,12 @@ bool Project::save()
             file << mVisitedFiles;
         }
         file << mDiagnostics;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            file << mHierarchy;
+        }
         saveDependencies(file, mDependencies);
+        file << mFileContents << mJobCosts;
         if (!file.flush()) {
             error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
             return false;
@@ -1140,6 +1375,9 @@ bool Project::dependsOn(uint32_t source, uint32_t header) const
 void Project::removeDependencies(uint32_t fileId)
 {
     // error() << "removeDependencies" << Location::path(fileId);
+    mFileGenerations[fileId] = mGeneration = nextGeneration();
+    mFileContents.remove(fileId);
+    mJobCostTotal -= mJobCosts.take(fileId);
     if (DependencyNode *node = mDependencies.take(fileId)) {
         for (auto it : node->includes)
             it.second->dependents.remove(fileId);
@@ -1147,6 +1385,8 @@ void Project::removeDependencies(uint32_t fileId)
             it.second->includes.remove(fileId);
         delete node;
     }
+    std::lock_guard<std::mutex> lock(mMutex);
+    removeHierarchy(fileId);
 }
 
 void Project::updateDependencies(uint32_t fileId, const std::shared_ptr<IndexDataMessage> &msg)
@@ -1250,6 +1490,38 @@ int Project::startDirtyJobs(Dirty *dirty, Flags<IndexerJob::Flag> flags,
     flags &= ~IndexerJob::NoAbort;
     assert(flags == IndexerJob::Dirty || flags == IndexerJob::Reindex);
 
+    // For each modified header the cheapest source that includes it runs
+    // first and is handed the header so its symbols are fresh quickly.
+    Hash<uint32_t, Set<uint32_t>> representatives;
+    if (flags == IndexerJob::Dirty && toIndex.size() > 1) {
+        List<uint32_t> headers;
+        for (uint32_t fileId : dirtyFiles) {
+            if (!toIndex.contains(fileId) && !hasSource(fileId))
+                headers.append(fileId);
+        }
+        if (headers.size() <= MaxRepresentativeHeaders) {
+            for (uint32_t header : headers) {
+                uint32_t best = 0;
+                uint64_t bestCost = 0;
+                for (uint32_t dependent : dependencies(header, DependsOnArg)) {
+                    if (!toIndex.contains(dependent) || mSuspendedFiles.contains(dependent))
+                        continue;
+                    if (representatives.contains(dependent)) {
+                        best = dependent;
+                        break;
+                    }
+                    const uint64_t cost = jobCost(dependent);
+                    if (!best || cost < bestCost) {
+                        best = dependent;
+                        bestCost = cost;
+                    }
+                }
+                if (best)
+                    representatives[best].insert(header);
+            }
+        }
+    }
+
     std::weak_ptr<Connection> weakConn = wait;
     for (uint32_t fileId : toIndex) {
         if (noAbort) {
@@ -1263,7 +1535,9 @@ int Project::startDirtyJobs(Dirty *dirty, Flags<IndexerJob::Flag> flags,
             continue;
         }
 
-        auto job = std::make_shared<IndexerJob>(sources(fileId), flags, shared_from_this(), unsavedFiles);
+        const Set<uint32_t> headers = representatives.value(fileId);
+        auto job = std::make_shared<IndexerJob>(sources(fileId), headers.empty() ? flags : flags | IndexerJob::Representative,
+                                                shared_from_this(), unsavedFiles);
         if (wait) {
             job->destroyed.connect([weakConn](IndexerJob *) {
                 // should arguably be refcounted but I don't know if anyone waits for multiple jobs
@@ -1273,6 +1547,15 @@ int Project::startDirtyJobs(Dirty *dirty, Flags<IndexerJob::Flag> flags,
             });
         }
         index(job);
+        if (!headers.empty() && mActiveJobs.value(fileId) == job) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (uint32_t header : headers) {
+                if (mVisitedFiles.insert(header)) {
+                    job->visited.insert(header);
+                    job->reserved.insert(header);
+                }
+            }
+        }
     }
 
     return toIndex.size();
@@ -1328,67 +1611,99 @@ void Project::updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts)
     }
 }
 
-void Project::updateDiagnostics(uint32_t fileId, const Diagnostics &diagnostics)
+void Project::updateHierarchy(const Set<uint32_t> &visited, HierarchyEdges &edges)
 {
-    // const bool debug = (Location::path(fileId) == "/home/abakken/temp/compl1/main.cpp");
-    // if (debug) {
-    //     error() << "GOT HERE" << diagnostics;
-    // }
-    Set<uint32_t> files;
-    {
-        auto it = mDiagnostics.begin();
-        const auto end = mDiagnostics.end();
-        uint32_t lastFileId = 0;
-        while (it != end) {
-            if (it->second.sourceFileId == fileId) {
-                const uint32_t f = it->first.fileId();
-                if (f != lastFileId) {
-                    files.insert(f);
-                    lastFileId = f;
-                }
-                // if (debug) {
-                //     error() << "erasing" << it->first << "for" << Location::path(fileId);
-                // }
-                mDiagnostics.erase(it++);
-            } else {
-                ++it;
-            }
-        }
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto v : visited)
+        removeHierarchy(v);
+
+    for (HierarchyEdge &edge : edges) {
+        const uint32_t fileId = edge.location.fileId();
+        if (!visited.contains(fileId))
+            continue;
+        addHierarchyEdge(edge);
+        mHierarchy[fileId].push_back(std::move(edge));
     }
+}
 
-    {
-        uint32_t lastFileId = 0;
-        for (const auto &it : diagnostics) {
-            const uint32_t f = it.first.fileId();
-            if (lastFileId != f) {
-                files.insert(f);
-                lastFileId = f;
-            }
-            // if (debug) {
-            //     error() << "inserting" << it.first << "for" << Location::path(fileId);
-            // }
+// called with mMutex held
+void Project::removeHierarchy(uint32_t fileId)
+{
+    const auto it = mHierarchy.find(fileId);
+    if (it == mHierarchy.end())
+        return;
+    for (const HierarchyEdge &edge : it->second) {
+        const std::pair<String, Location> derived(edge.derived, edge.location);
+        auto dit = mDerived.find(edge.base);
+        if (dit != mDerived.end() && dit->second.remove(derived) && dit->second.empty())
+            mDerived.erase(dit);
+        const std::pair<String, Location> base(edge.base, edge.location);
+        auto bit = mBases.find(edge.derived);
+        if (bit != mBases.end() && bit->second.remove(base) && bit->second.empty())
+            mBases.erase(bit);
+    }
+    mHierarchy.erase(it);
+}
 
-            mDiagnostics[it.first] = it.second;
+// called with mMutex held
+void Project::addHierarchyEdge(const HierarchyEdge &edge)
+{
+    mDerived[edge.base].insert(std::make_pair(edge.derived, edge.location));
+    mBases[edge.derived].insert(std::make_pair(edge.base, edge.location));
+}
+
+Set<std::pair<String, Location>> Project::findDerived(const String &usr) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDerived.value(usr);
+}
+
+Set<std::pair<String, Location>> Project::findBases(const String &usr) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBases.value(usr);
+}
+
+void Project::updateDiagnostics(uint32_t fileId, const Diagnostics &diagnostics)
+{
+    // Only the diagnostics this source produced last time are looked at and
+    // only the files whose diagnostics actually changed are sent out.
+    Set<uint32_t> files;
+    Set<Location> &locations = mDiagnosticsBySource[fileId];
+    for (const Location &loc : locations) {
+        auto it = mDiagnostics.find(loc);
+        if (it == mDiagnostics.end() || it->second.sourceFileId != fileId || diagnostics.contains(loc))
+            continue;
+        files.insert(loc.fileId());
+        mDiagnostics.erase(it);
+    }
+    locations.clear();
+
+    for (const auto &diagnostic : diagnostics) {
+        auto it = mDiagnostics.find(diagnostic.first);
+        if (it == mDiagnostics.end()) {
+            mDiagnostics[diagnostic.first] = diagnostic.second;
+            files.insert(diagnostic.first.fileId());
+        } else if (it->second != diagnostic.second) {
+            if (it->second.sourceFileId != fileId) {
+                auto other = mDiagnosticsBySource.find(it->second.sourceFileId);
+                if (other != mDiagnosticsBySource.end())
+                    other->second.remove(diagnostic.first);
+            }
+            it->second = diagnostic.second;
+            files.insert(diagnostic.first.fileId());
         }
+        locations.insert(diagnostic.first);
     }
+    if (locations.empty())
+        mDiagnosticsBySource.remove(fileId);
 
-    if (!files.empty() || !diagnostics.empty()) {
+    if (!files.empty()) {
         std::shared_ptr<Project> current = Server::instance()->currentProject();
         // We don't want to send diagnostics for project if the current project
         // is another build of the same path
-        if (!current || current.get() == this || current->path() != mPath) {
-            // if (debug) {
-            //     error() << "got stuff" << files.size() << diagnostics.size() << mDiagnostics.size();
-            // }
-            log([&](const std::shared_ptr<LogOutput> &output) {
-                if (output->testLog(RTags::DiagnosticsLevel)) {
-                    const String log = formatDiagnostics(mDiagnostics, queryFlags(output), Set<uint32_t>(files));
-                    if (!log.empty()) {
-                        output->log(log);
-                    }
-                }
-            });
-        }
+        if (!current || current.get() == this || current->path() != mPath)
+            logDiagnostics(mDiagnostics, files);
     }
 }
 
@@ -1613,18 +1928,9 @@ String Project::toCompileCommands() const
     return ret.toJSON(true);
 }
 
-Symbol Project::findSymbol(Location location, int *index)
+static Symbol symbolAt(const std::shared_ptr<FileMap<Location, Symbol>> &symbols,
+                       Location location, uint32_t idx, bool exact, int *index)
 {
-    if (index)
-        *index = -1;
-    if (location.isNull())
-        return Symbol();
-    auto symbols = openSymbols(location.fileId());
-    if (!symbols || !symbols->count())
-        return Symbol();
-
-    bool exact = false;
-    uint32_t idx = symbols->lowerBound(location, &exact);
     if (exact) {
         if (index)
             *index = idx;
@@ -1641,14 +1947,139 @@ Symbol Project::findSymbol(Location location, int *index)
         break;
     }
 
-    const Symbol &ret = symbols->valueAt(idx);
-    if (ret.location.fileId() != location.fileId()
-        || ret.location.line() != location.line()
-        || (location.column() - ret.location.column() >= ret.symbolLength)) {
+    const SymbolView view(symbols->valueData(idx));
+    const Location loc = view.location();
+    if (loc.fileId() != location.fileId()
+        || loc.line() != location.line()
+        || (location.column() - loc.column() >= view.symbolLength())) {
         return Symbol();
     }
     if (index)
         *index = idx;
+    return view.symbol();
+}
+
+Symbol Project::findSymbol(Location location, int *index)
+{
+    if (index)
+        *index = -1;
+    if (location.isNull())
+        return Symbol();
+    auto symbols = openSymbols(location.fileId());
+    if (!symbols || !symbols->count())
+        return Symbol();
+
+    bool exact = false;
+    const uint32_t idx = symbols->lowerBound(location, &exact);
+    return symbolAt(symbols, location, idx, exact, index);
+}
+
+template <typename Open>
+static void findSymbols(const Set<Location> &locations, Open &&open, Map<Location, Symbol> &ret)
+{
+    std::shared_ptr<FileMap<Location, Symbol>> symbols;
+    uint32_t fileId = 0;
+    uint32_t first = 0;
+    // locations are sorted by file and position so each file is opened once
+    // and every lookup only searches past the previous one
+    for (const Location location : locations) {
+        if (location.isNull())
+            continue;
+        if (location.fileId() != fileId) {
+            fileId = location.fileId();
+            symbols = open(fileId);
+            first = 0;
+        }
+        if (!symbols || !symbols->count())
+            continue;
+
+        bool exact = false;
+        const uint32_t idx = symbols->lowerBound(location, &exact, first);
+        if (idx == std::numeric_limits<uint32_t>::max()) {
+            first = symbols->count();
+        } else {
+            first = idx;
+        }
+        Symbol symbol = symbolAt(symbols, location, idx, exact, nullptr);
+        if (!symbol.isNull())
+            ret[location] = std::move(symbol);
+    }
+}
+
+Map<Location, Symbol> Project::findSymbols(const Set<Location> &locations)
+{
+    Map<Location, Symbol> ret;
+    ::findSymbols(locations, [this](uint32_t fileId) { return openSymbols(fileId); }, ret);
+    return ret;
+}
+
+Map<Location, Symbol> Project::findUsrSymbols(FileMapType type, const String &usr, const Set<uint32_t> &files)
+{
+    assert(type == Targets || type == Usrs);
+    assert(mFileMapScope);
+    const String tusr = Sandbox::encoded(usr);
+    const size_t threadCount = std::min<size_t>(std::max(ThreadPool::idealThreadCount(), 1),
+                                                files.size() / MinFilesPerScanThread);
+    if (threadCount <= 1) {
+        Set<Location> locations;
+        for (uint32_t fileId : files) {
+            auto fileMap = type == Targets ? openTargets(fileId) : openUsrs(fileId);
+            if (fileMap)
+                locations.unite(fileMap->value(tusr));
+        }
+        return findSymbols(locations);
+    }
+
+    // Scans of every file in the project open each map once so the
+    // FileMapScope cache doesn't help. The maps are loaded straight from
+    // disk on a few threads instead since FileMapScope isn't thread safe.
+    const List<uint32_t> fileIds = files.toList();
+    const uint32_t options = fileMapOptions();
+    struct Shard {
+        Map<Location, Symbol> symbols;
+        Set<uint32_t> accessed;
+        bool loadFailed { false };
+    };
+    List<Shard> shards(threadCount);
+    auto scan = [&](size_t idx) {
+        Shard &shard = shards[idx];
+        auto load = [&](auto &fileMap, uint32_t fileId, FileMapType t) {
+            shard.accessed.insert(fileId);
+            if (!fileMap->load(sourceFilePath(fileId, fileMapName(t)), options)) {
+                shard.loadFailed = true;
+                fileMap.reset();
+            }
+        };
+        Set<Location> locations;
+        for (size_t i=idx; i<fileIds.size(); i += threadCount) {
+            auto fileMap = std::make_shared<FileMap<String, Set<Location>>>();
+            load(fileMap, fileIds.at(i), type);
+            if (fileMap)
+                locations.unite(fileMap->value(tusr));
+        }
+        ::findSymbols(locations, [&](uint32_t fileId) {
+                auto fileMap = std::make_shared<FileMap<Location, Symbol>>();
+                load(fileMap, fileId, Symbols);
+                return fileMap;
+            }, shard.symbols);
+    };
+
+    List<std::thread> threads;
+    threads.reserve(threadCount - 1);
+    for (size_t i=1; i<threadCount; ++i)
+        threads.emplace_back(scan, i);
+    scan(0);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    Map<Location, Symbol> ret;
+    for (Shard &shard : shards) {
+        mFileMapScope->accessed.unite(shard.accessed);
+        if (shard.loadFailed)
+            mFileMapScope->loadFailed = true;
+        for (auto &it : shard.symbols)
+            ret[it.first] = std::move(it.second);
+    }
     return ret;
 }
 
@@ -1711,23 +2142,8 @@ Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMod
 {
     assert(fileId);
     Set<Symbol> ret;
-    String tusr = Sandbox::encoded(usr);
-    for (uint32_t file : dependencies(fileId, mode)) {
-        auto usrs = openUsrs(file);
-        // error() << usrs << Location::path(file) << usr;
-        if (usrs) {
-            // SBROOT
-            for (Location loc : usrs->value(tusr)) {
-                // error() << "got a loc" << loc;
-                const Symbol c = findSymbol(loc);
-                if (!c.isNull())
-                    ret.insert(c);
-            }
-            // for (int i=0; i<usrs->count(); ++i) {
-            //     error() << i << usrs->count() << usrs->keyAt(i) << usrs->valueAt(i);
-            // }
-        }
-    }
+    for (auto &it : findUsrSymbols(Usrs, usr, dependencies(fileId, mode)))
+        ret.insert(std::move(it.second));
 
     if (ret.empty() && usr.startsWith("/")) { // for break statements and includes
         Symbol sym;
@@ -1747,30 +2163,22 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
     // const bool isClazz = s.isClass();
     for (const Symbol &input : inputs) {
         //warning() << "Calling findReferences" << input.location;
-        auto process = [&](uint32_t dep) {
-            // error() << "Looking at file" << Location::path(dep) << "for input" << input.location;
-            auto targets = project->openTargets(dep);
-            if (targets) {
-                // SBROOT
-                const String tusr = Sandbox::encoded(input.usr);
-                const Set<Location> locations = targets->value(tusr);
-                // error() << "Got locations for usr" << input.usr << locations;
-                for (const auto &loc : locations) {
-                    auto sym = project->findSymbol(loc);
-                    if (filter(input, sym))
-                        ret.insert(sym);
-                }
+        auto process = [&](const Set<uint32_t> &files) {
+            for (const auto &it : project->findUsrSymbols(Project::Targets, input.usr, files)) {
+                if (filter(input, it.second))
+                    ret.insert(it.second);
             }
         };
         const Set<uint32_t> deps = project->dependencies(input.location.fileId(), Project::DependsOnArg);
-        for (auto dep : deps)
-            process(dep);
+        process(deps);
 
         if (ret.empty()) {
+            Set<uint32_t> rest;
             for (auto dep : project->dependencies()) {
                 if (!deps.contains(dep.first))
-                    process(dep.first);
+                    rest.insert(dep.first);
             }
+            process(rest);
         }
     }
     return ret;
@@ -1885,53 +2293,52 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
     if (symbol.kind != CXCursor_CXXMethod || !(symbol.flags & Symbol::VirtualMethod))
         return Set<Symbol>();
 
-    Symbol parent = [this](const Symbol &sym) {
-        for (const String &usr : findTargetUsrs(sym.location)) {
-            const Set<Symbol> syms = findByUsr(usr, sym.location.fileId(), ArgDependsOn);
-            for (const Symbol &s : syms) {
-                if (findTargetUsrs(s.location).empty()) {
-                    return s;
-                }
-            }
-        }
-        return sym;
-    }(symbol);
-
-    assert(!parent.isNull());
-    if (parent.isDefinition()) {
-        const auto target = findTarget(parent);
-        if (!target.isNull()) {
-            parent = target;
-        }
+    // walk up to the methods that don't override anything
+    Set<String> roots, seen;
+    List<String> queue;
+    queue.push_back(symbol.usr);
+    while (!queue.empty()) {
+        const String usr = queue.back();
+        queue.pop_back();
+        if (!seen.insert(usr))
+            continue;
+        const auto bases = findBases(usr);
+        if (bases.empty())
+            roots.insert(usr);
+        for (const auto &base : bases)
+            queue.push_back(base.first);
     }
 
-    Set<Symbol> symSet;
-    symSet.insert(parent);
-    Set<Symbol> ret = ::findReferences(symSet, shared_from_this(), [](const Symbol &, const Symbol &ref) {
-        // error() << "considering" << ref.location << ref.kindSpelling();
-        if (ref.kind == CXCursor_CXXMethod) {
-            return true;
+    // and collect every override below them
+    Set<Symbol> ret;
+    ret.insert(symbol);
+    for (const String &root : roots) {
+        ret.unite(findByUsr(root, symbol.location.fileId(), ArgDependsOn));
+        queue.push_back(root);
+    }
+    seen.clear();
+    while (!queue.empty()) {
+        const String usr = queue.back();
+        queue.pop_back();
+        if (!seen.insert(usr))
+            continue;
+        for (const auto &derived : findDerived(usr)) {
+            const Symbol sym = findSymbol(derived.second);
+            if (!sym.isNull() && sym.usr == derived.first)
+                ret.insert(sym);
+            queue.push_back(derived.first);
         }
-        return false;
-    });
-    ret.insert(parent);
-    const Symbol target = findTarget(parent);
-    if (!target.isNull())
-        ret.insert(target);
+    }
     return ret;
 }
 
 Set<String> Project::findTargetUsrs(Location loc)
 {
     Set<String> usrs;
-    auto targets = openTargets(loc.fileId());
-    if (targets) {
-        const int count = targets->count();
-        for (int i=0; i<count; ++i) {
-            if (targets->valueAt(i).contains(loc)) {
-                // SBROOT
-                usrs.insert(Sandbox::decoded(targets->keyAt(i)));
-            }
+    if (auto targetUsrs = openTargetUsrs(loc.fileId())) {
+        for (const String &usr : targetUsrs->value(loc)) {
+            // SBROOT
+            usrs.insert(Sandbox::decoded(usr));
         }
     }
     return usrs;
@@ -1945,14 +2352,10 @@ Set<String> Project::findTargetUsrs(const Symbol &symbol)
 
     Set<String> usrs;
     for (uint32_t fileId : dependencies(symbol.location.fileId(), DependsOnArg)) {
-        auto targets = openTargets(fileId);
-        if (targets) {
-            const int count = targets->count();
-            for (int i=0; i<count; ++i) {
-                if (targets->valueAt(i).contains(symbol.location)) {
-                    // SBROOT
-                    usrs.insert(Sandbox::decoded(targets->keyAt(i)));
-                }
+        if (auto targetUsrs = openTargetUsrs(fileId)) {
+            for (const String &usr : targetUsrs->value(symbol.location)) {
+                // SBROOT
+                usrs.insert(Sandbox::decoded(usr));
             }
         }
     }
@@ -1963,16 +2366,10 @@ Set<Symbol> Project::findSubclasses(const Symbol &symbol)
 {
     assert(symbol.isClass() && symbol.isDefinition());
     Set<Symbol> ret;
-    for (uint32_t dep : dependencies(symbol.location.fileId(), DependsOnArg)) {
-        auto symbols = openSymbols(dep);
-        if (symbols) {
-            const int count = symbols->count();
-            for (int i=0; i<count; ++i) {
-                const Symbol s = symbols->valueAt(i);
-                if (s.baseClasses.contains(symbol.usr))
-                    ret.insert(s);
-            }
-        }
+    for (const auto &derived : findDerived(symbol.usr)) {
+        const Symbol sym = findSymbol(derived.second);
+        if (!sym.isNull() && sym.usr == derived.first && sym.isClass())
+            ret.insert(sym);
     }
     return ret;
 }
@@ -2156,6 +2553,12 @@ bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
             if (!fileMap.load(path, opts, &error))
                 goto error;
         }
+        {
+            path = sourceFilePath(fileId, fileMapName(TargetUsrs));
+            FileMap<Location, Set<String>> fileMap;
+            if (!fileMap.load(path, opts, &error))
+                goto error;
+        }
         {
             path = sourceFilePath(fileId, fileMapName(Usrs));
             FileMap<String, Set<Location>> fileMap;
@@ -2169,7 +2572,7 @@ bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
         return false;
     } else {
         assert(mode == StatOnly);
-        for (auto type : { Symbols, SymbolNames, Targets, Usrs }) {
+        for (auto type : { Symbols, SymbolNames, Targets, TargetUsrs, Usrs }) {
             const Path p = sourceFilePath(fileId, fileMapName(type));
             if (!p.isFile()) {
                 Log(err) << "Error during validation:" << Location::path(fileId) << p << "doesn't exist";
@@ -2346,6 +2749,14 @@ void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::
         }
     }
 
+    if (args.empty() || args.contains("targetusrs")) {
+        if (auto tbl = openTargetUsrs(fileId, &err)) {
+            conn->write(formatTable("Target usrs:", tbl, msg->terminalWidth()));
+        } else {
+            conn->write(err);
+        }
+    }
+
     if (args.empty() || args.contains("usrs")) {
         if (auto tbl = openUsrs(fileId, &err)) {
             conn->write(formatTable("Usrs:", tbl, msg->terminalWidth()));
@@ -2355,12 +2766,42 @@ void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::
     }
 
     if (args.empty() || args.contains("tokens")) {
-        if (auto tbl = openTokens(fileId, &err)) {
-            conn->write(formatTable("Tokens:", tbl, msg->terminalWidth()));
+        if (auto toks = tokens(fileId)) {
+            conn->write("Tokens:");
+            for (const Token &token : *toks)
+                conn->write(token.toString());
         } else {
-            conn->write(err);
+            conn->write<256>("Failed to read %s", Location::path(fileId).constData());
+        }
+    }
+}
+
+std::shared_ptr<const List<Token>> Project::tokens(uint32_t fileId, const String &unsaved)
+{
+    if (!unsaved.empty())
+        return std::make_shared<List<Token>>(Token::tokenize(fileId, unsaved.constData(), unsaved.size()));
+
+    const Path path = Location::path(fileId);
+    const uint64_t lastModified = path.lastModifiedMs();
+    if (!lastModified)
+        return nullptr;
+    CachedTokens &cached = mTokensCache[fileId];
+    cached.lastUsed = ++mTokensCacheCounter;
+    if (cached.tokens && cached.lastModified == lastModified)
+        return cached.tokens;
+
+    const String contents = path.readAll();
+    cached.lastModified = lastModified;
+    cached.tokens = std::make_shared<List<Token>>(Token::tokenize(fileId, contents.constData(), contents.size()));
+    if (mTokensCache.size() > static_cast<size_t>(MaxCachedTokenFiles)) {
+        auto oldest = mTokensCache.begin();
+        for (auto it = mTokensCache.begin(); it != mTokensCache.end(); ++it) {
+            if (it->second.lastUsed < oldest->second.lastUsed)
+                oldest = it;
         }
+        mTokensCache.erase(oldest);
     }
+    return cached.tokens;
 }
 
 void Project::prepare(uint32_t fileId)
@@ -2373,6 +2814,7 @@ void Project::prepare(uint32_t fileId)
         openSymbolNames(fileId, &err);
         openSymbols(fileId, &err);
         openTargets(fileId, &err);
+        openTargetUsrs(fileId, &err);
         openUsrs(fileId, &err);
         debug() << "Prepared" << Location::path(fileId);
     }
@@ -2579,6 +3021,159 @@ void Project::fixPCH(Source &source)
     }
 }
 
+static inline String preambleKey(const Source &source)
+{
+    String key = Source::languageName(source.language);
+    key << ' ' << String::join(source.toCommandLine(Source::IncludeDefines|Source::IncludeIncludePaths|Source::FilterBlacklist
+                                                    |Source::ExcludeDefaultArguments|Source::ExcludeDefaultIncludePaths
+                                                    |Source::ExcludeDefaultDefines), ' ');
+    return key;
+}
+
+static inline bool isPreambleCandidate(const Source &source)
+{
+    switch (source.language) {
+    case Source::C:
+    case Source::CPlusPlus:
+    case Source::CPlusPlus11:
+        break;
+    default:
+        return false;
+    }
+    for (const auto &inc : source.includePaths) {
+        if (inc.type == Source::Include::Type_PCH)
+            return false;
+    }
+    return true;
+}
+
+Path Project::preamble(const Source &source)
+{
+    if (!(Server::instance()->options().options & Server::AutoPCH))
+        return Path();
+    auto it = mPreambles.find(mPreambleKeys.value(source.fileId));
+    if (it == mPreambles.end() || it->second.state != Preamble::Ready || preambleKey(source) != it->first)
+        return Path();
+
+    // only sources that start with exactly these headers can use it
+    Preamble &preamble = it->second;
+    const List<uint32_t> prefix = preamble.prefixes.value(source.fileId);
+    if (prefix.size() < preamble.includes.size()
+        || !std::equal(preamble.includes.begin(), preamble.includes.end(), prefix.begin())) {
+        return Path();
+    }
+    for (uint32_t fileId : preamble.includes) {
+        if (Location::path(fileId).lastModifiedMs() > preamble.built) {
+            preamble.state = Preamble::Idle;
+            return Path();
+        }
+    }
+    return preamble.header;
+}
+
+void Project::updatePreamble(const Source &source, const std::shared_ptr<IndexDataMessage> &msg)
+{
+    const uint32_t fileId = source.fileId;
+    const String key = isPreambleCandidate(source) ? preambleKey(source) : String();
+    const String old = mPreambleKeys.value(fileId);
+    if (!old.empty() && old != key) {
+        auto it = mPreambles.find(old);
+        if (it != mPreambles.end()) {
+            it->second.prefixes.remove(fileId);
+            if (it->second.prefixes.empty() && it->second.state != Preamble::Building) {
+                Path::rm(it->second.header);
+                Path::rm(it->second.header + ".gch");
+                mPreambles.erase(it);
+            }
+        }
+        mPreambleKeys.remove(fileId);
+    }
+    if (key.empty())
+        return;
+
+    Preamble &preamble = mPreambles[key];
+    if (msg->flags() & IndexDataMessage::ParseFailure) {
+        // Candidates never have a pch of their own so this one was ours
+        if (msg->flags() & IndexDataMessage::UsedPCH && preamble.state == Preamble::Ready) {
+            error() << "Disabling preamble" << preamble.header << "after parse failure in" << source.sourceFile();
+            preamble.state = Preamble::Failed;
+            dirty(fileId);
+        }
+        return;
+    }
+    if (preamble.header.empty()) {
+        preamble.source = source;
+        preamble.header = String::format<1024>("%spreambles/%zx.h", mProjectDataDir.constData(), std::hash<String>()(key));
+    }
+    mPreambleKeys[fileId] = key;
+    preamble.prefixes[fileId] = msg->includePrefix();
+}
+
+void Project::startPreambles()
+{
+    if (!(Server::instance()->options().options & Server::AutoPCH))
+        return;
+    for (auto &it : mPreambles) {
+        Preamble &preamble = it.second;
+        if (preamble.state != Preamble::Idle || preamble.prefixes.size() < static_cast<size_t>(PreambleMinSources))
+            continue;
+
+        // Walk the leading includes and keep extending the prefix with
+        // whatever header most of the remaining sources agree on.
+        List<const List<uint32_t> *> candidates;
+        for (const auto &prefix : preamble.prefixes)
+            candidates.append(&prefix.second);
+        List<uint32_t> includes;
+        while (true) {
+            const size_t idx = includes.size();
+            Hash<uint32_t, size_t> counts;
+            for (const List<uint32_t> *candidate : candidates) {
+                if (candidate->size() > idx)
+                    ++counts[candidate->at(idx)];
+            }
+            uint32_t best = 0;
+            size_t bestCount = 0;
+            for (const auto &count : counts) {
+                if (count.second > bestCount) {
+                    best = count.first;
+                    bestCount = count.second;
+                }
+            }
+            if (bestCount < static_cast<size_t>(PreambleMinSources))
+                break;
+            includes.append(best);
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [idx, best](const List<uint32_t> *candidate) {
+                        return candidate->size() <= idx || candidate->at(idx) != best;
+                    }), candidates.end());
+        }
+        if (includes.size() < static_cast<size_t>(PreambleMinIncludes))
+            continue;
+
+        preamble.includes = std::move(includes);
+        preamble.state = Preamble::Building;
+        Source source = preamble.source;
+        IndexerJob::prepareSource(source, shared_from_this());
+        List<String> args = source.toCommandLine(Source::Default|Source::ExcludeDefaultArguments
+                                                 |Source::ExcludeDefaultIncludePaths|Source::ExcludeDefaultDefines);
+        args << "-x" << (source.language == Source::C ? "c-header" : "c++-header");
+        List<Path> paths;
+        paths.reserve(preamble.includes.size());
+        for (uint32_t fileId : preamble.includes)
+            paths.append(Location::path(fileId));
+        PreambleThread *thread = new PreambleThread(shared_from_this(), it.first, preamble.header, paths, args);
+        thread->start(Thread::Normal, 8 * 1024 * 1024); // 8MiB stack size
+    }
+}
+
+void Project::onPreambleFinished(const String &key, bool ok, uint64_t built)
+{
+    auto it = mPreambles.find(key);
+    if (it == mPreambles.end())
+        return;
+    it->second.state = ok ? Preamble::Ready : Preamble::Failed;
+    it->second.built = built;
+}
+
 void Project::includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const
 {
     CompilerManager::applyToSource(source, CompilerManager::IncludeIncludePaths);
@@ -2865,11 +3460,12 @@ Map<Symbol, size_t> Project::findDeadFunctions(uint32_t fileId)
 
         const int count = symbols->count();
         for (int i=0; i<count; ++i) {
-            Symbol s = symbols->valueAt(i);
-            if (RTags::isFunction(s.kind)
-                && s.kind != CXCursor_Destructor
-                && s.kind != CXCursor_LambdaExpr
-                && !s.symbolName.startsWith("int main(")
+            const SymbolView view(symbols->valueData(i));
+            const CXCursorKind kind = view.kind();
+            if (!RTags::isFunction(kind) || kind == CXCursor_Destructor || kind == CXCursor_LambdaExpr)
+                continue;
+            Symbol s = view.symbol();
+            if (!s.symbolName.startsWith("int main(")
                 && !s.symbolName.startsWith("void main(")
                 && (!seen || seen->insert(s.usr))) {
                 const size_t callers = findCallers(s, 2).size();
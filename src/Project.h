@@ -21,6 +21,7 @@
 #include <mutex>
 #include <ctime>
 #include <functional>
+#include <limits>
 #include <memory>
 #include <unordered_map>
 
@@ -98,8 +99,8 @@ public:
         Symbols,
         SymbolNames,
         Targets,
-        Usrs,
-        Tokens
+        TargetUsrs,
+        Usrs
     };
     static const char *fileMapName(FileMapType type)
     {
@@ -107,8 +108,8 @@ public:
         case Symbols: return "symbols";
         case SymbolNames: return "symnames";
         case Targets: return "targets";
+        case TargetUsrs: return "targetusrs";
         case Usrs: return "usrs";
-        case Tokens: return "tokens";
         }
         return nullptr;
     }
@@ -127,18 +128,21 @@ public:
         assert(mFileMapScope);
         return mFileMapScope->openFileMap<String, Set<Location>>(Targets, fileId, mFileMapScope->targets, err);
     }
-    std::shared_ptr<FileMap<String, Set<Location>> > openUsrs(uint32_t fileId, String *err = nullptr)
+    std::shared_ptr<FileMap<Location, Set<String>> > openTargetUsrs(uint32_t fileId, String *err = nullptr)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location>>(Usrs, fileId, mFileMapScope->usrs, err);
+        return mFileMapScope->openFileMap<Location, Set<String>>(TargetUsrs, fileId, mFileMapScope->targetUsrs, err);
     }
-
-    std::shared_ptr<FileMap<uint32_t, Token>> openTokens(uint32_t fileId, String *err = nullptr)
+    std::shared_ptr<FileMap<String, Set<Location>> > openUsrs(uint32_t fileId, String *err = nullptr)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<uint32_t, Token>(Tokens, fileId, mFileMapScope->tokens, err);
+        return mFileMapScope->openFileMap<String, Set<Location>>(Usrs, fileId, mFileMapScope->usrs, err);
     }
 
+    // Tokens aren't stored by the indexer, they're lexed when asked for.
+    // Files on disk are cached until they change, unsaved contents never are.
+    std::shared_ptr<const List<Token>> tokens(uint32_t fileId, const String &unsaved = String());
+
 
     enum DependencyMode {
         DependsOnArg,
@@ -154,6 +158,19 @@ public:
                             Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>()) const;
     const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
     DependencyNode *dependencyNode(uint32_t fileId) const { return mDependencies.value(fileId); }
+    // false if the file was touched but its content is what we indexed
+    bool contentChanged(uint32_t fileId, uint64_t lastModified);
+    // parse time of the job whose content hash we have for fileId, the hash
+    // only speaks for sources parsed at or after it
+    uint64_t contentIndexed(uint32_t fileId) const
+    {
+        auto it = mFileContents.find(fileId);
+        return it == mFileContents.end() ? std::numeric_limits<uint64_t>::max() : it->second.indexed;
+    }
+    // expected duration in ms of indexing sourceFileId, the average over all
+    // sources if we haven't indexed it yet
+    uint64_t jobCost(uint32_t sourceFileId) const;
+    void updateJobCost(uint32_t sourceFileId, uint64_t ms);
 
     static bool readSources(const Path &path, IndexParseData &data, String *error);
     enum SymbolMatchType {
@@ -173,6 +190,13 @@ public:
     }
 
     Symbol findSymbol(Location location, int *index = nullptr);
+    // Same as calling findSymbol for each location but opens every file's
+    // symbols once. Locations without a symbol are left out.
+    Map<Location, Symbol> findSymbols(const Set<Location> &locations);
+    // Symbols at the locations stored for usr in the Targets or Usrs maps of
+    // files. Large sets of files are scanned on several threads.
+    Map<Location, Symbol> findUsrSymbols(FileMapType type, const String &usr, const Set<uint32_t> &files);
+    enum { MinFilesPerScanThread = 32 };
     Set<Symbol> findTargets(Location location) { return findTargets(findSymbol(location)); }
     Set<Symbol> findTargets(const Symbol &symbol);
     Symbol findTarget(Location location) { return RTags::bestTarget(findTargets(location)); }
@@ -256,12 +280,19 @@ public:
         std::lock_guard<std::mutex> lock(mMutex);
         return mVisitedFiles;
     }
-    void encodeVisitedFiles(Serializer &serializer)
+    // files a job has already been handed are not blocked for it
+    void encodeVisitedFiles(Serializer &serializer, const Set<uint32_t> &own)
     {
         std::lock_guard<std::mutex> lock(mMutex);
-        serializer << static_cast<uint32_t>(mVisitedFiles.size());
+        uint32_t count = 0;
         for (uint32_t fileId : mVisitedFiles) {
-            serializer << fileId << Location::path(fileId);
+            if (!own.contains(fileId))
+                ++count;
+        }
+        serializer << count;
+        for (uint32_t fileId : mVisitedFiles) {
+            if (!own.contains(fileId))
+                serializer << fileId << Location::path(fileId);
         }
     }
 
@@ -290,6 +321,14 @@ public:
 
     void beginScope(Flags<ScopeFlag> flags = NullFlags);
     void endScope();
+    // files whose maps were opened in the current scope
+    Set<uint32_t> fileMapScopeFiles() const { return mFileMapScope ? mFileMapScope->accessed : Set<uint32_t>(); }
+    // bumped whenever indexed data changes, fileGeneration() is the
+    // generation a file's data last changed in. Generations come from one
+    // server-wide counter so a project that is removed and added again
+    // never reuses the ones its predecessor handed out.
+    uint64_t generation() const { return mGeneration; }
+    uint64_t fileGeneration(uint32_t fileId) const { return std::max(mFileGenerations.value(fileId), mCreatedGeneration); }
     void dirty(uint32_t fileId);
     bool save();
     void prepare(uint32_t fileId);
@@ -299,8 +338,11 @@ public:
     void diagnoseAll();
     uint32_t fileMapOptions() const;
     void fixPCH(Source &source);
+    Path preamble(const Source &source);
+    void onPreambleFinished(const String &key, bool ok, uint64_t built);
     void includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const;
     size_t bytesWritten() const { return mBytesWritten; }
+    const IndexProfile &indexProfile() const { return mIndexProfile; }
     void destroy() { mSaveDirty = false; }
     enum VisitResult {
         Stop,
@@ -343,11 +385,18 @@ private:
     void updateDependencies(uint32_t fileId, const std::shared_ptr<IndexDataMessage> &msg);
     void loadFailed(uint32_t fileId);
     void updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts);
+    void updateHierarchy(const Set<uint32_t> &visited, HierarchyEdges &edges);
+    void removeHierarchy(uint32_t fileId);
+    void addHierarchyEdge(const HierarchyEdge &edge);
+    Set<std::pair<String, Location>> findDerived(const String &usr) const;
+    Set<std::pair<String, Location>> findBases(const String &usr) const;
     int startDirtyJobs(Dirty *dirty,
                        Flags<IndexerJob::Flag> type,
                        const UnsavedFiles &unsavedFiles = UnsavedFiles(),
                        const std::shared_ptr<Connection> &wait = std::shared_ptr<Connection>());
     void onDirtyTimeout(Timer *);
+    void updatePreamble(const Source &source, const std::shared_ptr<IndexDataMessage> &msg);
+    void startPreambles();
 
     struct FileMapScope {
         FileMapScope(const std::shared_ptr<Project> &proj, int m, Flags<ScopeFlag> f)
@@ -391,6 +440,7 @@ private:
                                                           Hash<uint32_t, std::shared_ptr<FileMap<Key, Value>> > &cache,
                                                           String *errPtr)
         {
+            accessed.insert(fileId);
             auto it = cache.find(fileId);
             if (it != cache.end()) {
                 poke(type, fileId);
@@ -422,14 +472,14 @@ private:
                         assert(targets.contains(e->key.fileId));
                         targets.remove(e->key.fileId);
                         break;
+                    case TargetUsrs:
+                        assert(targetUsrs.contains(e->key.fileId));
+                        targetUsrs.remove(e->key.fileId);
+                        break;
                     case Usrs:
                         assert(usrs.contains(e->key.fileId));
                         usrs.remove(e->key.fileId);
                         break;
-                    case Tokens:
-                        assert(tokens.contains(e->key.fileId));
-                        tokens.remove(e->key.fileId);
-                        break;
                     }
                     --openedFiles;
                 }
@@ -451,7 +501,8 @@ private:
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location>> >> symbolNames;
         Hash<uint32_t, std::shared_ptr<FileMap<Location, Symbol>> > symbols;
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location>> >> targets, usrs;
-        Hash<uint32_t, std::shared_ptr<FileMap<uint32_t, Token>> > tokens;
+        Hash<uint32_t, std::shared_ptr<FileMap<Location, Set<String>> >> targetUsrs;
+        Set<uint32_t> accessed;
         std::shared_ptr<Project> project;
         int openedFiles, totalOpened;
         const int max;
@@ -476,6 +527,11 @@ private:
     time_t mLastIdleTime { time(nullptr) };
 
     Diagnostics mDiagnostics;
+    // locations in mDiagnostics for each source file that produced them
+    Hash<uint32_t, Set<Location>> mDiagnosticsBySource;
+    Hash<uint32_t, FileContent> mFileContents;
+    Hash<uint32_t, uint64_t> mJobCosts;
+    uint64_t mJobCostTotal { 0 };
 
     Hash<uint32_t, std::shared_ptr<IndexerJob>> mActiveJobs;
 
@@ -492,7 +548,42 @@ private:
     Hash<uint32_t, DependencyNode*> mDependencies;
     Set<uint32_t> mSuspendedFiles;
 
+    static uint64_t nextGeneration();
+    const uint64_t mCreatedGeneration { nextGeneration() };
+    uint64_t mGeneration { mCreatedGeneration };
+    Hash<uint32_t, uint64_t> mFileGenerations;
+
+    // inheritance and override edges by the file they were found in and
+    // indexed in both directions, base usr -> derived and derived usr -> base
+    Hash<uint32_t, HierarchyEdges> mHierarchy;
+    Hash<String, Set<std::pair<String, Location>>> mDerived, mBases;
+
+    struct Preamble {
+        enum State {
+            Idle,
+            Building,
+            Ready,
+            Failed
+        } state { Idle };
+        Source source; // the arguments the pch is built with
+        Hash<uint32_t, List<uint32_t>> prefixes; // leading includes per source
+        List<uint32_t> includes;
+        Path header;
+        uint64_t built { 0 };
+    };
+    Hash<String, Preamble> mPreambles;
+    Hash<uint32_t, String> mPreambleKeys;
+
+    enum { MaxCachedTokenFiles = 16 };
+    struct CachedTokens {
+        uint64_t lastModified { 0 }, lastUsed { 0 };
+        std::shared_ptr<const List<Token>> tokens;
+    };
+    Hash<uint32_t, CachedTokens> mTokensCache;
+    uint64_t mTokensCacheCounter { 0 };
+
     size_t mBytesWritten { 0 };
+    IndexProfile mIndexProfile;
     bool mSaveDirty { false };
 
     mutable std::mutex mMutex;
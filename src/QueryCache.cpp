@@ -0,0 +1,117 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+
+#include "QueryCache.h"
+
+#include "Project.h"
+#include "QueryJob.h"
+#include "QueryMessage.h"
+#include "rct/Connection.h"
+#include "rct/Log.h"
+#include "rct/Serializer.h"
+
+QueryCache::QueryCache(size_t maxEntries)
+    : mMaxEntries(maxEntries)
+{
+}
+
+String QueryCache::key(const std::shared_ptr<QueryMessage> &query, const List<std::shared_ptr<Project>> &projects)
+{
+    String ret;
+    Serializer serializer(ret);
+    query->encode(serializer);
+    for (const auto &project : projects)
+        serializer << project->path();
+    return ret;
+}
+
+bool QueryCache::isValid(const std::shared_ptr<Entry> &entry, const List<std::shared_ptr<Project>> &projects) const
+{
+    if (entry->inputs.size() != projects.size())
+        return false;
+    for (size_t i=0; i<projects.size(); ++i) {
+        const uint64_t generation = entry->inputs[i].first;
+        if (projects[i]->generation() == generation)
+            continue;
+        for (uint32_t fileId : entry->inputs[i].second) {
+            if (projects[i]->fileGeneration(fileId) > generation)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool QueryCache::replay(const String &key, const List<std::shared_ptr<Project>> &projects,
+                        const std::shared_ptr<Connection> &conn, int *ret)
+{
+    const std::shared_ptr<Entry> entry = mEntries.value(key);
+    if (!entry)
+        return false;
+    mList.remove(entry);
+    if (!isValid(entry, projects)) {
+        mEntries.remove(key);
+        return false;
+    }
+    mList.push_back(entry);
+    debug() << "Replaying" << entry->output.size() << "cached lines for query";
+    String chunk;
+    for (const String &line : entry->output) {
+        if (line.empty())
+            continue;
+        if (!chunk.empty())
+            chunk += '\n';
+        chunk += line;
+        if (chunk.size() >= QueryJob::WriteChunkSize) {
+            const bool ok = conn->write(chunk);
+            chunk.clear();
+            if (!ok)
+                break;
+        }
+    }
+    if (!chunk.empty())
+        conn->write(chunk);
+    *ret = entry->ret;
+    return true;
+}
+
+void QueryCache::insert(const String &key, const List<std::shared_ptr<Project>> &projects,
+                        List<String> &&output, int ret)
+{
+    if (!mMaxEntries)
+        return;
+    size_t bytes = 0;
+    for (const String &line : output)
+        bytes += line.size();
+    if (bytes > MaxEntrySize)
+        return;
+
+    if (const std::shared_ptr<Entry> old = mEntries.take(key))
+        mList.remove(old);
+
+    auto entry = std::make_shared<Entry>();
+    entry->key = key;
+    entry->output = std::move(output);
+    entry->ret = ret;
+    entry->inputs.reserve(projects.size());
+    for (const auto &project : projects)
+        entry->inputs.push_back(std::make_pair(project->generation(), project->fileMapScopeFiles()));
+    mEntries[key] = entry;
+    mList.push_back(entry);
+    while (mEntries.size() > mMaxEntries) {
+        const std::shared_ptr<Entry> e = mList.takeFirst();
+        mEntries.remove(e->key);
+    }
+}
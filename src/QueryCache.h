@@ -0,0 +1,68 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+
+#ifndef QueryCache_h
+#define QueryCache_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+#include "rct/EmbeddedLinkedList.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+
+class Connection;
+class Project;
+class QueryMessage;
+
+// Output of queries that only depend on indexed data, keyed by the
+// encoded query. An entry remembers which files its job read and is
+// dropped once any of them has been indexed again.
+class QueryCache
+{
+public:
+    QueryCache(size_t maxEntries);
+
+    static String key(const std::shared_ptr<QueryMessage> &query, const List<std::shared_ptr<Project>> &projects);
+    bool replay(const String &key, const List<std::shared_ptr<Project>> &projects,
+                const std::shared_ptr<Connection> &conn, int *ret);
+    void insert(const String &key, const List<std::shared_ptr<Project>> &projects,
+                List<String> &&output, int ret);
+    size_t size() const { return mEntries.size(); }
+
+    enum { MaxEntrySize = 1024 * 1024 };
+private:
+    struct Entry {
+        String key;
+        List<String> output;
+        int ret { 0 };
+        // per project, in the order of the query's projects
+        List<std::pair<uint64_t, Set<uint32_t>>> inputs;
+
+        std::shared_ptr<Entry> next, prev;
+    };
+
+    bool isValid(const std::shared_ptr<Entry> &entry, const List<std::shared_ptr<Project>> &projects) const;
+
+    const size_t mMaxEntries;
+    Hash<String, std::shared_ptr<Entry>> mEntries;
+    EmbeddedLinkedList<std::shared_ptr<Entry>> mList;
+};
+
+#endif
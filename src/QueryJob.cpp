@@ -20,8 +20,10 @@
 #include <string.h>
 
 #include "Project.h"
+#include "QueryCache.h"
 #include "QueryMessage.h"
 #include "RTags.h"
+#include "Server.h"
 #include "rct/Connection.h"
 #include "FileMap.h"
 #include "Symbol.h"
@@ -31,7 +33,7 @@
 QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
                    List<std::shared_ptr<Project>> projects,
                    Flags<JobFlag> jobFlags)
-    : Project::FileMapScopeScope(projects), mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProjects(std::move(projects)), mFileFilter(0)
+    : Project::FileMapScopeScope(projects), mAborted(false), mLinesWritten(0), mLinesSkipped(0), mTruncated(false), mQueryMessage(query), mJobFlags(jobFlags), mProjects(std::move(projects)), mFileFilter(0), mRecording(false)
 {
     assert(query);
     if (query->flags() & QueryMessage::SilentQuery)
@@ -98,8 +100,13 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 {
     assert(mConnection);
     if (!(flags & IgnoreMax) && mQueryMessage) {
+        if (mLinesSkipped < mQueryMessage->pageOffset()) {
+            ++mLinesSkipped;
+            return true;
+        }
         const int max = mQueryMessage->max();
         if (max != -1 && mLinesWritten == max) {
+            mTruncated = true;
             return false;
         }
         assert(mLinesWritten < max || max == -1);
@@ -109,14 +116,44 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
     if (!(mJobFlags & QuietJob))
         warning("=> %s", out.constData());
 
-    if (mConnection) {
-        if (!mConnection->write(out)) {
-            abort();
-            return false;
-        }
+    if (mRecording)
+        mRecorded.push_back(out);
+
+    // rc prints one line per ResponseMessage and skips empty ones so lines
+    // can be sent in batches instead of one message per line.
+    if (out.empty())
+        return true;
+    if (!mBuffer.empty())
+        mBuffer += '\n';
+    mBuffer += out;
+    if (mBuffer.size() >= WriteChunkSize)
+        return flush();
+    return true;
+}
+
+bool QueryJob::isFull(Flags<WriteFlag> flags)
+{
+    // Don't bother formatting results that would only be dropped
+    if (flags & IgnoreMax || !mQueryMessage)
+        return false;
+    const int max = mQueryMessage->max();
+    if (max != -1 && mLinesWritten == max && mLinesSkipped >= mQueryMessage->pageOffset()) {
+        mTruncated = true;
         return true;
     }
+    return false;
+}
 
+bool QueryJob::flush()
+{
+    if (mBuffer.empty() || !mConnection)
+        return true;
+    const bool ok = mConnection->write(mBuffer);
+    mBuffer.clear();
+    if (!ok) {
+        abort();
+        return false;
+    }
     return true;
 }
 
@@ -165,12 +202,13 @@ bool QueryJob::locationToString(Location location,
                     auto fileMap = proj->openSymbols(location.fileId());
                     if (fileMap) {
                         while (idx > 0) {
-                            symbol = fileMap->valueAt(--idx);
-                            if (symbol.location.fileId() != fileId)
+                            const SymbolView view(fileMap->valueData(--idx));
+                            if (view.location().fileId() != fileId)
                                 break;
-                            if (symbol.isDefinition() && RTags::isContainer(symbol.kind)
-                                && comparePosition(line, column, symbol.startLine, symbol.startColumn) >= 0
-                                && comparePosition(line, column, symbol.endLine, symbol.endColumn) <= 0) {
+                            if (view.isDefinition() && RTags::isContainer(view.kind())
+                                && comparePosition(line, column, view.startLine(), view.startColumn()) >= 0
+                                && comparePosition(line, column, view.endLine(), view.endColumn()) <= 0) {
+                                symbol = view.symbol();
                                 if (containingFunction)
                                     cb(Piece_ContainingFunctionName, symbol.symbolName);
                                 if (containingFunctionLocation)
@@ -199,6 +237,8 @@ bool QueryJob::write(Location location, Flags<WriteFlag> flags)
             return false;
         flags |= Unfiltered;
     }
+    if (isFull(flags))
+        return false;
 
     String out;
     if (!locationToString(location,
@@ -269,6 +309,8 @@ String QueryJob::symbolToString(const Symbol &symbol) const
 
 bool QueryJob::write(const Symbol &symbol, Flags<WriteFlag> writeFlags)
 {
+    if (isFull(writeFlags))
+        return false;
     String out = symbolToString(symbol);
     if (!out.empty())
         return write(out, writeFlags | Unfiltered);
@@ -312,9 +354,27 @@ bool QueryJob::filter(const String &value) const
 int QueryJob::run(const std::shared_ptr<Connection> &connection)
 {
     assert(connection);
+    std::shared_ptr<QueryCache> cache;
+    String key;
+    if (mJobFlags & Cacheable && mQueryMessage->unsavedFiles().empty()) {
+        cache = Server::instance()->queryCache();
+        if (cache) {
+            key = QueryCache::key(mQueryMessage, mProjects);
+            int ret;
+            if (cache->replay(key, mProjects, connection, &ret))
+                return ret;
+            mRecording = true;
+        }
+    }
     mConnection = connection;
     const int ret = execute();
+    if (mTruncated && mQueryMessage->pageOffset() >= 0)
+        writeRaw(String::format<32>("next-page-offset %d", mQueryMessage->pageOffset() + mLinesWritten), IgnoreMax);
+    flush();
     mConnection = nullptr;
+    if (cache && !isAborted())
+        cache->insert(key, mProjects, std::move(mRecorded), ret);
+    mRecording = false;
     return ret;
 }
 
@@ -50,9 +50,12 @@ public:
         None = 0x0,
         WriteUnfiltered = 0x1,
         QuoteOutput = 0x2,
-        QuietJob = 0x4
+        QuietJob = 0x4,
+        Cacheable = 0x8 // output only depends on the file maps the job reads
     };
     enum { Priority = 10 };
+    // Output lines are joined into ResponseMessages of about this size
+    enum { WriteChunkSize = 64 * 1024 };
     QueryJob(const std::shared_ptr<QueryMessage> &msg,
              List<std::shared_ptr<Project>> proj,
              Flags<JobFlag> jobFlags = Flags<JobFlag>());
@@ -112,7 +115,8 @@ public:
     bool isAborted() const { std::lock_guard<std::mutex> lock(mMutex); return mAborted; }
     void abort() { std::lock_guard<std::mutex> lock(mMutex); mAborted = true; }
     std::mutex &mutex() const { return mMutex; }
-    const std::shared_ptr<Connection> &connection() const { return mConnection; }
+    // flushes buffered output so direct writes stay in order
+    const std::shared_ptr<Connection> &connection() { flush(); return mConnection; }
     bool filterLocation(Location loc) const;
     bool filterKind(const Symbol &symbol) const { return mKindFilters.filter(symbol); }
 private:
@@ -158,8 +162,11 @@ private:
 
     mutable std::mutex mMutex;
     bool mAborted;
-    int mLinesWritten;
+    int mLinesWritten, mLinesSkipped;
+    bool mTruncated;
     bool writeRaw(const String &out, Flags<WriteFlag> flags);
+    bool isFull(Flags<WriteFlag> flags);
+    bool flush();
     std::shared_ptr<QueryMessage> mQueryMessage;
     Flags<JobFlag> mJobFlags;
     Signal<std::function<void(const String &)>> mOutput;
@@ -169,6 +176,8 @@ private:
     QueryMessage::KindFilters mKindFilters;
     Set<String> mPieceFilters;
     String mBuffer;
+    bool mRecording;
+    List<String> mRecorded;
     std::shared_ptr<Connection> mConnection;
     Hash<Path, String> mContextCache;
 };
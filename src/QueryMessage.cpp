@@ -24,21 +24,21 @@
 #include "rct/Rct.h"
 
 QueryMessage::QueryMessage(Type type)
-    : RTagsMessage(MessageId), mType(type), mMax(-1), mMaxDepth(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1)
+    : RTagsMessage(MessageId), mType(type), mMax(-1), mPageOffset(-1), mMaxDepth(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1)
 {
 }
 
 void QueryMessage::encode(Serializer &serializer) const
 {
     serializer << mCommandLine << mQuery << mCodeCompletePrefix << mType << mFlags << mMax
-               << mMaxDepth << mMinLine << mMaxLine << mBuildIndex << mPathFilters << mKindFilters
+               << mPageOffset << mMaxDepth << mMinLine << mMaxLine << mBuildIndex << mPathFilters << mKindFilters
                << mCurrentFile << mUnsavedFiles << mTerminalWidth;
 }
 
 void QueryMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mCommandLine >> mQuery >> mCodeCompletePrefix >> mType >> mFlags >> mMax
-                 >> mMaxDepth >> mMinLine >> mMaxLine >> mBuildIndex >> mPathFilters >> mKindFilters
+                 >> mPageOffset >> mMaxDepth >> mMinLine >> mMaxLine >> mBuildIndex >> mPathFilters >> mKindFilters
                  >> mCurrentFile >> mUnsavedFiles >> mTerminalWidth;
 }
 
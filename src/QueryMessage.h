@@ -225,6 +225,9 @@ public:
     int max() const { return mMax; }
     void setMax(int max) { mMax = max; }
 
+    int pageOffset() const { return mPageOffset; }
+    void setPageOffset(int offset) { mPageOffset = offset; }
+
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> flags)
     {
@@ -260,7 +263,7 @@ private:
     String mQuery, mCodeCompletePrefix;
     Type mType;
     Flags<QueryMessage::Flag> mFlags;
-    int mMax, mMaxDepth, mMinLine, mMaxLine, mBuildIndex;
+    int mMax, mPageOffset, mMaxDepth, mMinLine, mMaxLine, mBuildIndex;
     List<PathFilter> mPathFilters;
     KindFilters mKindFilters;
     Path mCurrentFile;
@@ -16,6 +16,7 @@
 #include "RClient.h"
 
 #include <stdio.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <assert.h>
 #include <ctype.h>
@@ -69,6 +70,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType>> opts = {
     { RClient::None, String(), 0, CommandLineParser::NoValue, "Rdm:" },
     { RClient::QuitRdm, "quit-rdm", 'q', CommandLineParser::NoValue, "Tell server to shut down with optional exit code as argument." },
     { RClient::ConnectTimeout, "connect-timeout", 0, CommandLineParser::Required, "Timeout for connecting to rdm in ms (default " STR(DEFAULT_CONNECT_TIMEOUT)  ")." },
+    { RClient::Pipe, "pipe", 0, CommandLineParser::NoValue, "Read \"<id> <arguments>\" lines from stdin and send them to rdm over one connection without waiting for each to finish." },
 
     { RClient::None, String(), 0, CommandLineParser::NoValue, "" },
     { RClient::None, String(), 0, CommandLineParser::NoValue, "Project management:" },
@@ -137,6 +139,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType>> opts = {
     { RClient::None, String(), 0, CommandLineParser::NoValue, "Command flags:" },
     { RClient::StripParen, "strip-paren", 'p', CommandLineParser::NoValue, "Strip parens in various contexts." },
     { RClient::Max, "max", 'M', CommandLineParser::Required, "Max lines of output for queries." },
+    { RClient::PageOffset, "page-offset", 0, CommandLineParser::Required, "Skip this many lines of output for queries. Use with --max to page through results, the last line of a page that has more output is \"next-page-offset N\"." },
     { RClient::MultiProject, "multi-project", 0, CommandLineParser::NoValue, "Search in all projects with the same source dir." },
     { RClient::ReverseSort, "reverse-sort", 'O', CommandLineParser::NoValue, "Sort output reversed." },
     { RClient::Rename, "rename", 0, CommandLineParser::NoValue, "Used for --references to indicate that we're using the results to rename symbols." },
@@ -210,6 +213,13 @@ public:
     virtual ~RCCommand() {}
     virtual RTags::ExitCode exec(RClient *rc, const std::shared_ptr<Connection> &connection) = 0;
     virtual String description() const = 0;
+
+    enum PipeMode {
+        Pipelined, // rdm finishes it before handling the next message
+        Barrier, // may finish asynchronously, send it on its own
+        Unsupported // never finishes
+    };
+    virtual PipeMode pipeMode(const RClient *) const { return Barrier; }
 };
 
 class QueryCommand : public RCCommand
@@ -238,6 +248,7 @@ public:
         msg.setUnsavedFiles(rc->unsavedFiles());
         msg.setFlags(extraQueryFlags | rc->queryFlags());
         msg.setMax(rc->max());
+        msg.setPageOffset(rc->pageOffset());
         msg.setPathFilters(rc->pathFilters());
         msg.setKindFilters(rc->kindFilters());
         msg.setRangeFilter(rc->minOffset(), rc->maxOffset());
@@ -252,6 +263,47 @@ public:
     {
         return ("QueryMessage " + String::number(type) + " " + query);
     }
+
+    // Only queries rdm is known to answer before it reads the next message
+    // can be pipelined, everything else (completions, --dump-file,
+    // --preprocess, --asm, --wait, ...) may finish later.
+    virtual PipeMode pipeMode(const RClient *rc) const override
+    {
+        if ((extraQueryFlags | rc->queryFlags()) & QueryMessage::Wait)
+            return Barrier;
+        switch (type) {
+        case QueryMessage::ClassHierarchy:
+        case QueryMessage::DeadFunctions:
+        case QueryMessage::DebugLocations:
+        case QueryMessage::Dependencies:
+        case QueryMessage::DumpCompileCommands:
+        case QueryMessage::DumpCompletions:
+        case QueryMessage::DumpFileMaps:
+        case QueryMessage::FindFile:
+        case QueryMessage::FindSymbols:
+        case QueryMessage::FixIts:
+        case QueryMessage::FollowLocation:
+        case QueryMessage::HasFileManager:
+        case QueryMessage::IncludeFile:
+        case QueryMessage::IncludePath:
+        case QueryMessage::IsIndexed:
+        case QueryMessage::IsIndexing:
+        case QueryMessage::JobCount:
+        case QueryMessage::LastIndexed:
+        case QueryMessage::ListSymbols:
+        case QueryMessage::Project:
+        case QueryMessage::ReferencesLocation:
+        case QueryMessage::ReferencesName:
+        case QueryMessage::Sources:
+        case QueryMessage::Status:
+        case QueryMessage::SymbolInfo:
+        case QueryMessage::Tokens:
+            return Pipelined;
+        default:
+            break;
+        }
+        return Barrier;
+    }
 };
 
 class QuitCommand : public RCCommand
@@ -298,6 +350,7 @@ public:
     {
         return "RdmLogCommand";
     }
+    virtual PipeMode pipeMode(const RClient *) const override { return Unsupported; }
     const LogLevel mLevel;
 };
 
@@ -337,10 +390,11 @@ public:
 };
 
 RClient::RClient()
-    : mMax(-1), mMaxDepth(-1), mTimeout(-1), mMinOffset(-1), mMaxOffset(-1),
+    : mMax(-1), mPageOffset(-1), mMaxDepth(-1), mTimeout(-1), mMinOffset(-1), mMaxOffset(-1),
       mConnectTimeout(DEFAULT_CONNECT_TIMEOUT), mBuildIndex(0),
       mLogLevel(LogLevel::Error), mTcpPort(0), mGuessFlags(false),
-      mTerminalWidth(-1), mExitCode(RTags::ArgumentParseError)
+      mTerminalWidth(-1), mExitCode(RTags::ArgumentParseError), mPipe(false),
+      mPipeRequest(false), mPipeEof(false), mPipeBarrier(false)
 {
     struct winsize w;
     ioctl(0, TIOCGWINSZ, &w);
@@ -351,7 +405,9 @@ RClient::RClient()
 
 RClient::~RClient()
 {
-    cleanupLogging();
+    stopPipe();
+    if (!mPipeRequest)
+        cleanupLogging();
 }
 
 void RClient::addQuery(QueryMessage::Type type, String &&query, Flags<QueryMessage::Flag> extraQueryFlags)
@@ -382,25 +438,17 @@ void RClient::addCompile(Path &&path)
     mCommands.push_back(std::make_shared<CompileCommand>(std::move(path)));
 }
 
-void RClient::exec()
+std::shared_ptr<Connection> RClient::connect(const std::shared_ptr<EventLoop> &loop)
 {
-    RTags::initMessages();
-    OnDestruction onDestruction([]() { Message::cleanup(); });
-    std::shared_ptr<EventLoop> loop(new EventLoop);
-    loop->init(EventLoop::MainEventLoop);
-
-    const int commandCount = mCommands.size();
     std::shared_ptr<Connection> connection = Connection::create(NumOptions);
     connection->newMessage().connect(std::bind(&RClient::onNewMessage, this,
                                                std::placeholders::_1, std::placeholders::_2));
-    connection->finished().connect(std::bind([](){ EventLoop::eventLoop()->quit(); }));
-    connection->disconnected().connect(std::bind([](){ EventLoop::eventLoop()->quit(); }));
     if (mTcpPort) {
         if (!connection->connectTcp(mTcpHost, mTcpPort, mConnectTimeout)) {
             if (mLogLevel >= LogLevel::Error)
                 fprintf(stdout, "Can't seem to connect to server (%s:%d)\n", mTcpHost.constData(), mTcpPort);
             mExitCode = RTags::ConnectionFailure;
-            return;
+            return nullptr;
         }
         connection->connected().connect(std::bind(&EventLoop::quit, loop.get()));
         loop->exec(mConnectTimeout);
@@ -413,15 +461,36 @@ void RClient::exec()
                 }
             }
             mExitCode = RTags::ConnectionFailure;
-            return;
+            return nullptr;
         }
     } else if (!connection->connectUnix(mSocketFile, mConnectTimeout)) {
         if (mLogLevel >= LogLevel::Error)
             fprintf(stdout, "Can't seem to connect to server (%s)\n", mSocketFile.constData());
         mExitCode = RTags::ConnectionFailure;
+        return nullptr;
+    }
+    return connection;
+}
+
+void RClient::exec()
+{
+    RTags::initMessages();
+    OnDestruction onDestruction([]() { Message::cleanup(); });
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    if (mPipe) {
+        execPipe(loop);
         return;
     }
 
+    const int commandCount = mCommands.size();
+    std::shared_ptr<Connection> connection = connect(loop);
+    if (!connection)
+        return;
+    connection->finished().connect(std::bind([](){ EventLoop::eventLoop()->quit(); }));
+    connection->disconnected().connect(std::bind([](){ EventLoop::eventLoop()->quit(); }));
+
     for (int i=0; i<commandCount; ++i) {
         const std::shared_ptr<RCCommand> &cmd = mCommands.at(i);
         debug() << "running command " << cmd->description();
@@ -439,6 +508,225 @@ void RClient::exec()
     mCommands.clear();
 }
 
+static List<String> splitPipeLine(const String &line)
+{
+    List<String> ret;
+    String cur;
+    bool hasArg = false;
+    char quote = '\0';
+    for (size_t i=0; i<line.size(); ++i) {
+        const char ch = line.at(i);
+        if (ch == '\\' && quote != '\'' && i + 1 < line.size()) {
+            cur.append(line.at(++i));
+            hasArg = true;
+        } else if (quote) {
+            if (ch == quote) {
+                quote = '\0';
+            } else {
+                cur.append(ch);
+            }
+        } else if (ch == '"' || ch == '\'') {
+            quote = ch;
+            hasArg = true;
+        } else if (isspace(static_cast<unsigned char>(ch))) {
+            if (hasArg) {
+                ret.push_back(std::move(cur));
+                cur.clear();
+                hasArg = false;
+            }
+        } else {
+            cur.append(ch);
+            hasArg = true;
+        }
+    }
+    if (hasArg)
+        ret.push_back(std::move(cur));
+    return ret;
+}
+
+void RClient::execPipe(const std::shared_ptr<EventLoop> &loop)
+{
+    mPipeConnection = connect(loop);
+    if (!mPipeConnection)
+        return;
+    mExitCode = RTags::Success;
+    mPipeConnection->finished().connect(std::bind(&RClient::onPipeFinished, this));
+    mPipeConnection->disconnected().connect(std::bind([this]() {
+                if (!mPipePending.empty() || !mPipeOutstanding.empty())
+                    mExitCode = RTags::NetworkFailure;
+                EventLoop::eventLoop()->quit();
+            }));
+
+    // stdin is read on its own thread so responses can be written while the
+    // client is still sending requests. Unsaved files passed as
+    // --unsaved-file=file:bytes are read from stdin right after their line.
+    // stdin is unbuffered so polling it tells whether a line is waiting.
+    if (::pipe(mPipeWakeup) == -1) {
+        error("Failed to create pipe (%d)", errno);
+        mExitCode = RTags::GeneralFailure;
+        return;
+    }
+    setvbuf(stdin, nullptr, _IONBF, 0);
+    mPipeThread = std::thread(std::bind(&RClient::readPipe, this));
+    loop->exec();
+    stopPipe();
+
+    if (mPipeConnection->client())
+        mPipeConnection->client()->close();
+    mPipePending.clear();
+    mPipeOutstanding.clear();
+    mPipeConnection.reset();
+}
+
+void RClient::readPipe()
+{
+    char *buf = nullptr;
+    size_t cap = 0;
+    ssize_t read;
+    bool stopped = false;
+    while (true) {
+        pollfd fds[] = { { STDIN_FILENO, POLLIN, 0 }, { mPipeWakeup[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents) {
+            stopped = true;
+            break;
+        }
+        if ((read = getline(&buf, &cap, stdin)) == -1)
+            break;
+        const String line(buf, read);
+        List<String> args = splitPipeLine(line);
+        if (args.empty())
+            continue;
+
+        auto request = std::make_shared<PipeRequest>();
+        request->id = std::move(args.front());
+        args.front() = "rc";
+        request->client = std::make_shared<RClient>();
+        request->client->mPipeRequest = true;
+        std::vector<char *> argv(args.size());
+        for (size_t i=0; i<args.size(); ++i)
+            argv[i] = args[i].data();
+        const CommandLineParser::ParseStatus status = request->client->parse(argv.size(), argv.data());
+        switch (status.status) {
+        case CommandLineParser::Parse_Error:
+            request->error = status.error;
+            request->status = RTags::ArgumentParseError;
+            break;
+        case CommandLineParser::Parse_Ok:
+            request->status = request->client->exitCode();
+            break;
+        case CommandLineParser::Parse_Exec:
+            break;
+        }
+        EventLoop::mainEventLoop()->callLater([this, request]() { onPipeRequest(request); });
+    }
+    free(buf);
+    if (stopped)
+        return;
+    EventLoop::mainEventLoop()->callLater([this]() {
+            mPipeEof = true;
+            processPipe();
+        });
+}
+
+void RClient::stopPipe()
+{
+    if (!mPipeThread.joinable())
+        return;
+    // a line that is only partially written still has to arrive before the
+    // thread notices
+    const char c = 'q';
+    while (::write(mPipeWakeup[1], &c, 1) == -1 && errno == EINTR)
+        ;
+    mPipeThread.join();
+    ::close(mPipeWakeup[0]);
+    ::close(mPipeWakeup[1]);
+    mPipeWakeup[0] = mPipeWakeup[1] = -1;
+}
+
+void RClient::onPipeRequest(const std::shared_ptr<PipeRequest> &request)
+{
+    if (!request->error.empty())
+        writePipe(request->id, ':', request->error);
+    for (const std::shared_ptr<RCCommand> &cmd : request->client->mCommands) {
+        if (cmd->pipeMode(request->client.get()) == RCCommand::Unsupported) {
+            writePipe(request->id, ':', cmd->description() + " can't be used with --pipe");
+            request->status = RTags::ArgumentParseError;
+        }
+    }
+    if (request->status != RTags::Success || request->client->mCommands.empty()) {
+        writePipe(request->id, '=', String::number(request->status));
+        return;
+    }
+    request->remaining = request->client->mCommands.size();
+    for (const std::shared_ptr<RCCommand> &cmd : request->client->mCommands)
+        mPipePending.push_back({ request, cmd });
+    request->client->mCommands.clear();
+    processPipe();
+}
+
+void RClient::processPipe()
+{
+    // rdm handles the messages of a connection in order and finishes each
+    // pipelined one before reading the next, barriers run alone. The
+    // oldest outstanding command therefore owns every response until its
+    // finish message arrives.
+    while (!mPipeBarrier && !mPipePending.empty()) {
+        const PipeCommand &front = mPipePending.front();
+        const bool barrier = front.command->pipeMode(front.request->client.get()) == RCCommand::Barrier;
+        if (barrier && !mPipeOutstanding.empty())
+            break;
+        PipeCommand cmd = front;
+        mPipePending.pop_front();
+        debug() << "running command " << cmd.request->id << " " << cmd.command->description();
+        const RTags::ExitCode ret = cmd.command->exec(cmd.request->client.get(), mPipeConnection);
+        if (ret != RTags::Success) {
+            finishPipeCommand(cmd, ret);
+            continue;
+        }
+        mPipeOutstanding.push_back(std::move(cmd));
+        mPipeBarrier = barrier;
+    }
+    if (mPipeEof && mPipePending.empty() && mPipeOutstanding.empty())
+        EventLoop::eventLoop()->quit();
+}
+
+void RClient::onPipeFinished()
+{
+    if (mPipeOutstanding.empty()) {
+        error("Unexpected finish message");
+        return;
+    }
+    const PipeCommand cmd = mPipeOutstanding.front();
+    mPipeOutstanding.pop_front();
+    if (mPipeOutstanding.empty())
+        mPipeBarrier = false;
+    finishPipeCommand(cmd, mPipeConnection->finishStatus());
+    processPipe();
+}
+
+void RClient::finishPipeCommand(const PipeCommand &cmd, int status)
+{
+    if (cmd.request->status == RTags::Success)
+        cmd.request->status = status;
+    if (!--cmd.request->remaining)
+        writePipe(cmd.request->id, '=', String::number(cmd.request->status));
+}
+
+void RClient::writePipe(const String &id, char separator, const String &data)
+{
+    String text = data;
+    if (text.endsWith('\n'))
+        text.chop(1);
+    for (const String &line : text.split('\n'))
+        fprintf(stdout, "%s%c%s\n", id.constData(), separator, line.constData());
+    fflush(stdout);
+}
+
 CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
 {
     Rct::findExecutablePath(*argv);
@@ -496,6 +784,12 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
         case GuessFlags: {
             mGuessFlags = true;
             break; }
+        case Pipe: {
+            if (mPipeRequest) {
+                return { "--pipe can't be used in --pipe mode", CommandLineParser::Parse_Error };
+            }
+            mPipe = true;
+            break; }
         case Wait: {
             mQueryFlags |= QueryMessage::Wait;
             break; }
@@ -711,6 +1005,13 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
                 return { String::format<1024>("-M [arg] must be >= 0"), CommandLineParser::Parse_Error };
             }
             break; }
+        case PageOffset: {
+            bool ok;
+            mPageOffset = value.toULongLong(&ok);
+            if (!ok) {
+                return { String::format<1024>("--page-offset [arg] must be >= 0"), CommandLineParser::Parse_Error };
+            }
+            break; }
         case Timeout: {
             mTimeout = atoi(value.constData());
             if (!mTimeout) {
@@ -1350,12 +1651,17 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
     if (ret.status != CommandLineParser::Parse_Exec)
         return ret;
 
-    if (!initLogging(argv[0], logFlags, mLogLevel, logFile)) {
+    if (!mPipeRequest && !initLogging(argv[0], logFlags, mLogLevel, logFile)) {
         return { String::format<1024>("Can't initialize logging with %d %s %s", mLogLevel.toInt(), logFile.constData(), logFlags.toString().constData()), CommandLineParser::Parse_Error };
     }
 
-    if (mCommands.empty()) {
-        help(stderr, argv[0], opts);
+    if (mPipe) {
+        if (!mCommands.empty()) {
+            return { "--pipe can't be combined with other commands", CommandLineParser::Parse_Error };
+        }
+    } else if (mCommands.empty()) {
+        if (!mPipeRequest)
+            help(stderr, argv[0], opts);
         return { "No commands", CommandLineParser::Parse_Error };
     }
     if (mCommands.size() > projectCommands.size()) {
@@ -1372,7 +1678,7 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
         }
     }
 
-    if (!logFile.empty() || mLogLevel > LogLevel::Error) {
+    if (!mPipeRequest && (!logFile.empty() || mLogLevel > LogLevel::Error)) {
         Log l(LogLevel::Warning);
         l << argc;
         for (size_t i = 0; i < argc; ++i)
@@ -1386,7 +1692,11 @@ void RClient::onNewMessage(const std::shared_ptr<Message> &message, const std::s
 {
     if (message->messageId() == ResponseMessage::MessageId) {
         const String response = std::static_pointer_cast<ResponseMessage>(message)->data();
-        if (!response.empty() && mLogLevel >= LogLevel::Error) {
+        if (mPipe && !mPipeOutstanding.empty()) {
+            const PipeCommand &cmd = mPipeOutstanding.front();
+            if (!response.empty() && cmd.request->client->logLevel() >= LogLevel::Error)
+                writePipe(cmd.request->id, ':', response);
+        } else if (!response.empty() && mLogLevel >= LogLevel::Error) {
             fprintf(stdout, "%s\n", response.constData());
             fflush(stdout);
         }
@@ -19,8 +19,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <memory>
+#include <thread>
 
 #include "QueryMessage.h"
+#include "rct/LinkedList.h"
 #include "rct/List.h"
 #include "rct/Message.h"
 #include "rct/Path.h"
@@ -35,6 +37,7 @@
 class RCCommand;
 class QueryCommand;
 class Connection;
+class EventLoop;
 class Message;
 
 class RClient
@@ -124,7 +127,9 @@ public:
         NoSortReferencesByInput,
         NoSpellCheckinging,
         Noop,
+        PageOffset,
         PathFilter,
+        Pipe,
         PreprocessFile,
         Project,
         ProjectRoot,
@@ -179,6 +184,7 @@ public:
     CommandLineParser::ParseStatus parse(size_t argc, char **argv);
 
     int max() const { return mMax; }
+    int pageOffset() const { return mPageOffset; }
     int maxDepth() const { return mMaxDepth; }
     LogLevel logLevel() const { return mLogLevel; }
     int timeout() const { return mTimeout; }
@@ -215,8 +221,35 @@ private:
     void addCompile(String &&args, const Path &cwd);
     void addCompile(Path &&compileCommands);
 
+    std::shared_ptr<Connection> connect(const std::shared_ptr<EventLoop> &loop);
+
+    // --pipe mode. Each line on stdin is "<id> <rc arguments>", every command
+    // is sent without waiting for the previous one to finish and output is
+    // written as "<id>:<line>" followed by "<id>=<exit code>".
+    struct PipeRequest
+    {
+        String id;
+        std::shared_ptr<RClient> client;
+        String error;
+        int status { 0 };
+        size_t remaining { 0 };
+    };
+    struct PipeCommand
+    {
+        std::shared_ptr<PipeRequest> request;
+        std::shared_ptr<RCCommand> command;
+    };
+    void execPipe(const std::shared_ptr<EventLoop> &loop);
+    void readPipe();
+    void stopPipe();
+    void onPipeRequest(const std::shared_ptr<PipeRequest> &request);
+    void onPipeFinished();
+    void finishPipeCommand(const PipeCommand &command, int status);
+    void processPipe();
+    void writePipe(const String &id, char separator, const String &data);
+
     Flags<QueryMessage::Flag> mQueryFlags;
-    int mMax, mMaxDepth, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout, mBuildIndex;
+    int mMax, mPageOffset, mMaxDepth, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout, mBuildIndex;
     LogLevel mLogLevel;
     Set<QueryMessage::PathFilter> mPathFilters;
     QueryMessage::KindFilters mKindFilters;
@@ -234,6 +267,12 @@ private:
     int mExitCode;
     mutable List<String> mEnvironment;
 
+    bool mPipe, mPipeRequest, mPipeEof, mPipeBarrier;
+    std::shared_ptr<Connection> mPipeConnection;
+    LinkedList<PipeCommand> mPipePending, mPipeOutstanding;
+    std::thread mPipeThread;
+    int mPipeWakeup[2] { -1, -1 };
+
     String mCommandLine;
     friend class CompileCommand;
 };
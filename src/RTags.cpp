@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <map>
@@ -46,6 +47,57 @@
 #include "rct/Date.h"
 #include "rct/Message.h"
 
+IndexProfile &IndexProfile::operator+=(const IndexProfile &other)
+{
+    jobs += other.jobs;
+    parse += other.parse;
+    visit += other.visit;
+    visitFileWait += other.visitFileWait;
+    write += other.write;
+    encode += other.encode;
+    visitFileQueries += other.visitFileQueries;
+    cursors += other.cursors;
+    blockedCursors += other.blockedCursors;
+    bytesWritten += other.bytesWritten;
+    unchangedFileMaps += other.unchangedFileMaps;
+    for (const auto &kind : other.kinds) {
+        Kind &k = kinds[kind.first];
+        k.count += kind.second.count;
+        k.time += kind.second.time;
+    }
+    return *this;
+}
+
+String IndexProfile::toString() const
+{
+    auto ms = [](uint64_t us) { return static_cast<double>(us) / 1000.0; };
+    String ret = String::format<1024>("jobs: %llu\n"
+                                      "parse: %.1fms\n"
+                                      "visit: %.1fms (visitFileWait: %.1fms, %llu queries)\n"
+                                      "write: %.1fms (encode: %.1fms, %llu bytes, %llu file maps unchanged)\n"
+                                      "cursors: %llu (blocked: %llu)",
+                                      static_cast<unsigned long long>(jobs), ms(parse),
+                                      ms(visit), ms(visitFileWait), static_cast<unsigned long long>(visitFileQueries),
+                                      ms(write), ms(encode), static_cast<unsigned long long>(bytesWritten),
+                                      static_cast<unsigned long long>(unchangedFileMaps),
+                                      static_cast<unsigned long long>(cursors), static_cast<unsigned long long>(blockedCursors));
+    if (!kinds.isEmpty()) {
+        List<std::pair<uint16_t, Kind> > sorted;
+        sorted.reserve(kinds.size());
+        for (const auto &kind : kinds)
+            sorted.append(kind);
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint16_t, Kind> &l, const std::pair<uint16_t, Kind> &r) {
+                return l.second.time > r.second.time;
+            });
+        for (const auto &kind : sorted) {
+            ret += String::format<128>("\n  %s: %llu cursors %.1fms",
+                                       Symbol::kindSpelling(kind.first).constData(),
+                                       static_cast<unsigned long long>(kind.second.count), ms(kind.second.time));
+        }
+    }
+    return ret;
+}
+
 namespace RTags {
 String versionString()
 {
@@ -134,6 +186,42 @@ Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t com
     return str;
 }
 
+// MurmurHash64A
+uint64_t contentHash(const char *data, size_t size)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = 0x5bd1e9955bd1e995ull ^ (size * m);
+
+    const char *end = data + (size & ~static_cast<size_t>(7));
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += sizeof(k);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size & 7) {
+    case 7: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[6])) << 48; // fall through
+    case 6: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[5])) << 40; // fall through
+    case 5: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[4])) << 32; // fall through
+    case 4: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[3])) << 24; // fall through
+    case 3: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[2])) << 16; // fall through
+    case 2: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[1])) << 8; // fall through
+    case 1: h ^= static_cast<uint64_t>(static_cast<unsigned char>(data[0]));
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 Path findAncestor(const Path& path, const String &fn, Flags<FindAncestorFlag> flags, SourceCache *cache)
 {
     Path *cacheResult = nullptr;
@@ -76,6 +76,91 @@ typedef Map<Path, Set<String>> Files;
 typedef Hash<uint32_t, Set<FixIt>> FixIts;
 typedef Hash<Path, String> UnsavedFiles;
 
+// base is a base class or an overridden method, location is where the
+// derived class or the overriding method is declared
+struct HierarchyEdge
+{
+    String base, derived;
+    Location location;
+};
+typedef List<HierarchyEdge> HierarchyEdges;
+
+template <> inline Serializer &operator<<(Serializer &s, const HierarchyEdge &e)
+{
+    s << e.base << e.derived << e.location;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, HierarchyEdge &e)
+{
+    s >> e.base >> e.derived >> e.location;
+    return s;
+}
+
+// Where an indexer job spent its time, times are in microseconds
+struct IndexProfile
+{
+    uint64_t jobs { 0 }, parse { 0 }, visit { 0 }, visitFileWait { 0 }, write { 0 }, encode { 0 };
+    uint64_t visitFileQueries { 0 }, cursors { 0 }, blockedCursors { 0 }, bytesWritten { 0 };
+    // file maps that already held what we would have written
+    uint64_t unchangedFileMaps { 0 };
+    struct Kind {
+        uint64_t count { 0 }, time { 0 };
+    };
+    // indexVisitor time per cursor kind, not including VisitFile waits. Only
+    // collected with rdm --indexer-profile.
+    Map<uint16_t, Kind> kinds;
+
+    IndexProfile &operator+=(const IndexProfile &other);
+    String toString() const;
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const IndexProfile::Kind &k)
+{
+    s << k.count << k.time;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, IndexProfile::Kind &k)
+{
+    s >> k.count >> k.time;
+    return s;
+}
+
+template <> inline Serializer &operator<<(Serializer &s, const IndexProfile &p)
+{
+    s << p.jobs << p.parse << p.visit << p.visitFileWait << p.write << p.encode
+      << p.visitFileQueries << p.cursors << p.blockedCursors << p.bytesWritten << p.unchangedFileMaps << p.kinds;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, IndexProfile &p)
+{
+    s >> p.jobs >> p.parse >> p.visit >> p.visitFileWait >> p.write >> p.encode
+      >> p.visitFileQueries >> p.cursors >> p.blockedCursors >> p.bytesWritten >> p.unchangedFileMaps >> p.kinds;
+    return s;
+}
+
+// Content hash of a file as it was indexed, used to tell a touched file from
+// a modified one. indexed is the parse time of the job that recorded the
+// hash, sources parsed before that never saw this content.
+struct FileContent
+{
+    uint64_t lastModified { 0 }, hash { 0 }, indexed { 0 };
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const FileContent &c)
+{
+    s << c.lastModified << c.hash << c.indexed;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, FileContent &c)
+{
+    s >> c.lastModified >> c.hash >> c.indexed;
+    return s;
+}
+
 struct SourceCache;
 
 inline bool operator==(const CXCursor &l, CXCursorKind r)
@@ -294,30 +379,14 @@ struct DiagnosticsProvider
 
     inline Location createLocation(const CXSourceLocation &location, bool *blocked = nullptr, unsigned *offset = nullptr)
     {
-        CXString fileName;
         unsigned int line, col;
         CXFile file;
         clang_getSpellingLocation(location, &file, &line, &col, offset);
-        if (file) {
-            fileName = clang_getFileName(file);
-        } else {
-            if (blocked)
-                *blocked = false;
-            return Location();
-        }
-        const char *fn = clang_getCString(fileName);
-        assert(fn);
-        if (!*fn || !strcmp("<built-in>", fn) || !strcmp("<command line>", fn)) {
-            if (blocked)
-                *blocked = false;
-            clang_disposeString(fileName);
-            return Location();
-        }
-        const Path path = RTags::eatString(fileName);
-        const Location ret = createLocation(path, line, col, blocked);
-        return ret;
+        return createLocation(file, line, col, blocked);
     }
-    inline Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = nullptr)
+    // Every CXSourceLocation and cursor based createLocation ends up here so
+    // subclasses can cache the lookup per file.
+    virtual Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = nullptr)
     {
         if (blocked)
             *blocked = false;
@@ -326,7 +395,7 @@ struct DiagnosticsProvider
 
         CXString fn = clang_getFileName(file);
         const char *cstr = clang_getCString(fn);
-        if (!cstr) {
+        if (!cstr || !*cstr || !strcmp("<built-in>", cstr) || !strcmp("<command line>", cstr)) {
             clang_disposeString(fn);
             return Location();
         }
@@ -759,6 +828,8 @@ Path encodeSourceFilePath(const Path &dataDir,
                           uint32_t fileId = 0);
 String encodeUrlComponent(const String &string);
 String decodeUrlComponent(const String &string);
+uint64_t contentHash(const char *data, size_t size);
+inline uint64_t contentHash(const String &contents) { return contentHash(contents.constData(), contents.size()); }
 
 template <typename Container, typename Value>
 inline bool addTo(Container &container, const Value &value)
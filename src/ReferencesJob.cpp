@@ -39,7 +39,7 @@ static inline Flags<QueryJob::JobFlag> jobFlags(Flags<QueryMessage::Flag> queryF
 }
 
 ReferencesJob::ReferencesJob(Location loc, const std::shared_ptr<QueryMessage> &query, List<std::shared_ptr<Project>> &&projects)
-    : QueryJob(query, std::move(projects), ::jobFlags(query->flags()))
+    : QueryJob(query, std::move(projects), ::jobFlags(query->flags()) | Cacheable)
 {
     mLocations.insert(loc);
 }
@@ -75,16 +75,23 @@ int ReferencesJob::execute()
     }
     const bool declarationOnly = queryFlags() & QueryMessage::DeclarationOnly;
     const bool definitionOnly = queryFlags() & QueryMessage::DefinitionOnly;
+    Map<Location, Symbol> symbols;
+    {
+        Set<Location> remaining = mLocations;
+        for (const auto &proj : projects()) {
+            if (remaining.empty())
+                break;
+            for (auto &it : proj->findSymbols(remaining)) {
+                remaining.remove(it.first);
+                symbols[it.first] = std::move(it.second);
+            }
+        }
+    }
     Location startLocation;
     bool first = true;
     for (auto it = mLocations.begin(); it != mLocations.end(); ++it) {
         const Location pos = *it;
-        Symbol sym;
-        for (const auto &proj : projects()) {
-            sym = proj->findSymbol(pos);
-            if (!sym.isNull())
-                break;
-        }
+        Symbol sym = symbols.value(pos);
         if (sym.isNull())
             continue;
         if (first && !(queryFlags() & QueryMessage::NoSortReferencesByInput)) {
@@ -34,6 +34,7 @@
 #include "Match.h"
 #include "Preprocessor.h"
 #include "Project.h"
+#include "QueryCache.h"
 #include "RClient.h"
 #include "IndexParseData.h"
 #include "rct/Connection.h"
@@ -203,6 +204,8 @@ bool Server::init(const Options &options)
         error() << "Failed to start job scheduler";
         return false;
     }
+    if (mOptions.queryCacheSize > 0)
+        mQueryCache.reset(new QueryCache(mOptions.queryCacheSize));
 
     if (!load())
         return false;
@@ -1299,7 +1302,7 @@ void Server::sourceFileModified(const std::shared_ptr<Project> &project, uint32_
 void Server::prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint32_t fileId, const List<std::shared_ptr<Project>> &projects)
 {
     if (query->flags() & QueryMessage::CodeCompletionEnabled && !mCompletionThread) {
-        mCompletionThread = new CompletionThread(mOptions.completionCacheSize);
+        mCompletionThread = new CompletionThread(mOptions.completionCacheSize, mOptions.completionCacheMemory, mOptions.completionWorkerCount);
         mCompletionThread->start();
     }
 
@@ -53,6 +53,7 @@ class Match;
 class CompletionThread;
 class Connection;
 class IndexDataMessage;
+class QueryCache;
 class QueryJob;
 class LogOutputMessage;
 class Message;
@@ -105,14 +106,17 @@ public:
         Separate32BitAnd64Bit = (1ull << 31),
         SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32),
         NoLibClangIncludePath = (1ull << 33),
-        CompletionDiagnostics = (1ull << 34)
+        CompletionDiagnostics = (1ull << 34),
+        AutoPCH = (1ull << 35),
+        IndexerProfile = (1ull << 36),
+        AdaptiveJobCount = (1ull << 37)
     };
     struct Options {
         Options()
-            : jobCount(0), maxIncludeCompletionDepth(0),
+            : jobCount(0), minJobCount(1), maxIncludeCompletionDepth(0),
               rpVisitFileTimeout(0), rpIndexDataMessageTimeout(0), rpConnectTimeout(0),
               rpConnectAttempts(0), rpNiceValue(0), maxCrashCount(0),
-              completionCacheSize(0), testTimeout(60 * 1000 * 5),
+              completionCacheSize(0), completionCacheMemory(0), completionWorkerCount(1), queryCacheSize(0), testTimeout(60 * 1000 * 5),
               maxFileMapScopeCacheSize(512), pollTimer(0), maxSocketWriteBufferSize(0),
               daemonCount(DEFAULT_RP_DAEMON_COUNT), tcpPort(0)
         {
@@ -120,10 +124,10 @@ public:
 
         Path socketFile, dataDir, argTransform, rp, sandboxRoot, tempDir;
         Flags<Option> options;
-        size_t jobCount, maxIncludeCompletionDepth;
+        size_t jobCount, minJobCount, maxIncludeCompletionDepth;
         int rpVisitFileTimeout, rpIndexDataMessageTimeout,
             rpConnectTimeout, rpConnectAttempts, rpNiceValue, maxCrashCount,
-            completionCacheSize, testTimeout, maxFileMapScopeCacheSize, errorLimit,
+            completionCacheSize, completionCacheMemory, completionWorkerCount, queryCacheSize, testTimeout, maxFileMapScopeCacheSize, errorLimit,
             pollTimer, maxSocketWriteBufferSize, daemonCount;
         uint16_t tcpPort;
         List<String> defaultArguments, excludeFilters;
@@ -145,6 +149,7 @@ public:
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     void dumpDaemons(const std::shared_ptr<Connection> &conn);
     std::shared_ptr<JobScheduler> jobScheduler() const { return mJobScheduler; }
+    std::shared_ptr<QueryCache> queryCache() const { return mQueryCache; }
     enum ActiveBufferType {
         Inactive,
         Active,
@@ -261,6 +266,7 @@ private:
     int mPollTimer, mExitCode;
     uint32_t mLastFileId;
     std::shared_ptr<JobScheduler> mJobScheduler;
+    std::shared_ptr<QueryCache> mQueryCache;
     CompletionThread *mCompletionThread;
     bool mActiveBuffersSet;
     Hash<uint32_t, ActiveBufferType> mActiveBuffers;
@@ -1584,7 +1584,7 @@ void Server::codeCompleteAt(const std::shared_ptr<QueryMessage> &query, const st
     }
 
     if (!mCompletionThread) {
-        mCompletionThread = new CompletionThread(mOptions.completionCacheSize);
+        mCompletionThread = new CompletionThread(mOptions.completionCacheSize, mOptions.completionCacheMemory, mOptions.completionWorkerCount);
         mCompletionThread->start();
     }
 
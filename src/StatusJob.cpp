@@ -50,7 +50,7 @@ int StatusJob::execute()
         return !strncasecmp(query.constData(), name, query.size());
     };
     bool matched = false;
-    const char *alternatives = "fileids|watchedpaths|dependencies|cursors|symbols|targets|symbolnames|sources|jobs|daemon|info|compilers|memory|project";
+    const char *alternatives = "fileids|watchedpaths|dependencies|cursors|symbols|targets|symbolnames|sources|jobs|daemon|info|compilers|memory|project|profile";
 
     if (match("fileids")) {
         matched = true;
@@ -289,6 +289,13 @@ int StatusJob::execute()
         matched = true;
     }
 
+    if (query.empty() || match("profile")) {
+        if (!write(delimiter) || !write("profile") || !write(delimiter))
+            return 1;
+        write(proj->indexProfile().toString());
+        matched = true;
+    }
+
     if (!matched) {
         write<256>("rc -s %s", alternatives);
         return 1;
@@ -227,11 +227,12 @@ String Symbol::toString(const List<std::shared_ptr<Project>> &projects,
             const unsigned int column = location.column();
             bool done = false;
             while (idx-- > 0) {
-                const Symbol s = syms->valueAt(idx);
-                if (s.isDefinition()
-                    && s.isContainer()
-                    && comparePosition(line, column, s.startLine, s.startColumn) >= 0
-                    && comparePosition(line, column, s.endLine, s.endColumn) <= 0) {
+                const SymbolView view(syms->valueData(idx));
+                if (view.isDefinition()
+                    && RTags::isContainer(view.kind())
+                    && comparePosition(line, column, view.startLine(), view.startColumn()) >= 0
+                    && comparePosition(line, column, view.endLine(), view.endColumn()) <= 0) {
+                    const Symbol s = view.symbol();
                     if (cursorInfoFlags & IncludeContainingFunctionLocation)
                         writePiece("Containing function location", "cfl", s.location.toString(locationToStringFlags));
                     if (cursorInfoFlags & IncludeContainingFunction)
@@ -511,11 +512,12 @@ Value Symbol::toValue(const List<std::shared_ptr<Project>> &projects,
                     const unsigned int column = symbol.location.column();
                     bool done = false;
                     while (idx-- > 0) {
-                        const Symbol s = syms->valueAt(idx);
-                        if (s.isDefinition()
-                            && s.isContainer()
-                            && comparePosition(line, column, s.startLine, s.startColumn) >= 0
-                            && comparePosition(line, column, s.endLine, s.endColumn) <= 0) {
+                        const SymbolView view(syms->valueData(idx));
+                        if (view.isDefinition()
+                            && RTags::isContainer(view.kind())
+                            && comparePosition(line, column, view.startLine(), view.startColumn()) >= 0
+                            && comparePosition(line, column, view.endLine(), view.endColumn()) <= 0) {
+                            const Symbol s = view.symbol();
                             if (f & IncludeContainingFunctionLocation) {
                                 formatLocation(s.location, "cfl", "cflcontext");
                             }
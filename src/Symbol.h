@@ -16,9 +16,12 @@
 #ifndef RTagsCursor_h
 #define RTagsCursor_h
 
+#include <assert.h>
 #include <clang-c/Index.h>
+#include <limits.h>
 #include <memory>
 #include <stdint.h>
+#include <string.h>
 
 #include "Location.h"
 #include "Sandbox.h"
@@ -214,14 +217,16 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol::ArgumentUsa
     return s;
 }
 
+// The fixed size fields go first so SymbolView can read them straight out
+// of a mapped file map.
 template <> inline Serializer &operator<<(Serializer &s, const Symbol &t)
 {
-    s << t.location << t.argumentUsage << t.symbolName << t.usr
-      << t.typeName << t.baseClasses << t.arguments << t.symbolLength
-      << static_cast<uint16_t>(t.kind) << static_cast<uint16_t>(t.type)
-      << static_cast<uint8_t>(t.linkage) << t.flags << t.mangledName << t.briefComment << t.xmlComment
-      << t.enumValue << t.startLine << t.endLine << t.startColumn << t.endColumn
-      << t.size << t.fieldOffset << t.alignment;
+    s << t.location << static_cast<uint16_t>(t.kind) << static_cast<uint16_t>(t.type)
+      << static_cast<uint8_t>(t.linkage) << t.flags << t.symbolLength
+      << t.startLine << t.endLine << t.startColumn << t.endColumn
+      << t.usr << t.argumentUsage << t.symbolName << t.typeName << t.baseClasses << t.arguments
+      << t.mangledName << t.briefComment << t.xmlComment
+      << t.enumValue << t.size << t.fieldOffset << t.alignment;
     return s;
 }
 
@@ -229,12 +234,11 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol &t)
 {
     uint16_t kind, type;
     uint8_t linkage;
-    s >> t.location >> t.argumentUsage >> t.symbolName
-      >> t.usr >> t.typeName >> t.baseClasses >> t.arguments
-      >> t.symbolLength >> kind >> type >> linkage >> t.flags
-      >> t.mangledName >> t.briefComment >> t.xmlComment >> t.enumValue
+    s >> t.location >> kind >> type >> linkage >> t.flags >> t.symbolLength
       >> t.startLine >> t.endLine >> t.startColumn >> t.endColumn
-      >> t.size >> t.fieldOffset >> t.alignment;
+      >> t.usr >> t.argumentUsage >> t.symbolName >> t.typeName >> t.baseClasses >> t.arguments
+      >> t.mangledName >> t.briefComment >> t.xmlComment
+      >> t.enumValue >> t.size >> t.fieldOffset >> t.alignment;
 
     t.kind = static_cast<CXCursorKind>(kind);
     t.type = static_cast<CXTypeKind>(type);
@@ -248,6 +252,76 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol &t)
     return s;
 }
 
+// A serialized Symbol in a mapped file map. The fixed size fields are
+// read on demand, usr() and symbol() decode the rest.
+class SymbolView
+{
+public:
+    SymbolView(const char *data = nullptr)
+        : mData(data)
+    {}
+
+    bool isNull() const { return !mData || location().isNull() || clang_isInvalid(kind()); }
+    Location location() const { return read<Location>(LocationOffset); }
+    CXCursorKind kind() const { return static_cast<CXCursorKind>(read<uint16_t>(KindOffset)); }
+    CXTypeKind type() const { return static_cast<CXTypeKind>(read<uint16_t>(TypeOffset)); }
+    CXLinkageKind linkage() const { return static_cast<CXLinkageKind>(read<uint8_t>(LinkageOffset)); }
+    uint16_t flags() const { return read<uint16_t>(FlagsOffset); }
+    uint16_t symbolLength() const { return read<uint16_t>(SymbolLengthOffset); }
+    int32_t startLine() const { return read<int32_t>(StartLineOffset); }
+    int32_t endLine() const { return read<int32_t>(EndLineOffset); }
+    int16_t startColumn() const { return read<int16_t>(StartColumnOffset); }
+    int16_t endColumn() const { return read<int16_t>(EndColumnOffset); }
+
+    bool isDefinition() const { return flags() & Symbol::Definition; }
+    bool isClass() const { return Symbol::isClass(kind()); }
+
+    String usr() const
+    {
+        assert(mData);
+        String ret;
+        Deserializer deserializer(mData + UsrOffset, INT_MAX);
+        deserializer >> ret;
+        Sandbox::decode(ret);
+        return ret;
+    }
+
+    Symbol symbol() const
+    {
+        Symbol ret;
+        if (mData) {
+            Deserializer deserializer(mData, INT_MAX);
+            deserializer >> ret;
+        }
+        return ret;
+    }
+private:
+    enum {
+        LocationOffset = 0,
+        KindOffset = LocationOffset + sizeof(uint64_t),
+        TypeOffset = KindOffset + sizeof(uint16_t),
+        LinkageOffset = TypeOffset + sizeof(uint16_t),
+        FlagsOffset = LinkageOffset + sizeof(uint8_t),
+        SymbolLengthOffset = FlagsOffset + sizeof(uint16_t),
+        StartLineOffset = SymbolLengthOffset + sizeof(uint16_t),
+        EndLineOffset = StartLineOffset + sizeof(int32_t),
+        StartColumnOffset = EndLineOffset + sizeof(int32_t),
+        EndColumnOffset = StartColumnOffset + sizeof(int16_t),
+        UsrOffset = EndColumnOffset + sizeof(int16_t)
+    };
+
+    template <typename T>
+    T read(size_t offset) const
+    {
+        assert(mData);
+        T t;
+        memcpy(&t, mData + offset, sizeof(T));
+        return t;
+    }
+
+    const char *mData;
+};
+
 static inline Log operator<<(Log dbg, const Symbol &symbol)
 {
     const String out = "Symbol(" + symbol.toString() + ")";
@@ -32,7 +32,7 @@ SymbolInfoJob::SymbolInfoJob(Location s, Location e,
                              Set<String> &&pieceFilters,
                              const std::shared_ptr<QueryMessage> &query,
                              List<std::shared_ptr<Project>> &&projects)
-    : QueryJob(query, std::move(projects)), start(s), end(e)
+    : QueryJob(query, std::move(projects), Cacheable), start(s), end(e)
 {
     setPieceFilters(std::move(pieceFilters));
 }
@@ -15,7 +15,12 @@
 
 #include "Token.h"
 
+#include <ctype.h>
+#include <string.h>
+#include <initializer_list>
+
 #include "rct/List.h"
+#include "rct/Set.h"
 
 String Token::toString() const
 {
@@ -38,3 +43,177 @@ String Token::toString() const
     return ret;
 
 }
+
+static inline bool isIdentifierStart(char ch)
+{
+    return isalpha(static_cast<unsigned char>(ch)) || ch == '_' || ch == '$' || (ch & 0x80);
+}
+
+static inline bool isIdentifierChar(char ch)
+{
+    return isIdentifierStart(ch) || isdigit(static_cast<unsigned char>(ch));
+}
+
+static inline bool isKeyword(const String &word)
+{
+    static const Set<String> keywords = []() {
+        Set<String> ret;
+        for (const char *keyword : {
+            "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break",
+            "case", "catch", "char", "char16_t", "char32_t", "char8_t", "class", "co_await", "co_return",
+            "co_yield", "compl", "concept", "const", "const_cast", "consteval", "constexpr", "constinit",
+            "continue", "decltype", "default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+            "explicit", "export", "extern", "false", "float", "for", "friend", "goto", "if", "inline",
+            "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq", "nullptr",
+            "operator", "or", "or_eq", "private", "protected", "public", "register", "reinterpret_cast",
+            "requires", "restrict", "return", "short", "signed", "sizeof", "static", "static_assert",
+            "static_cast", "struct", "switch", "template", "this", "thread_local", "throw", "true", "try",
+            "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void", "volatile",
+            "wchar_t", "while", "xor", "xor_eq", "_Alignas", "_Alignof", "_Atomic", "_Bool", "_Complex",
+            "_Generic", "_Imaginary", "_Noreturn", "_Static_assert", "_Thread_local", "__attribute__",
+            "__declspec", "__typeof__", "typeof", "__restrict", "__inline", "__asm__" }) {
+            ret.insert(keyword);
+        }
+        return ret;
+    }();
+    return keywords.contains(word);
+}
+
+// L"", u8"", u'', R"x()x" and friends
+static inline bool isLiteralPrefix(const char *str, uint32_t len, char quote, bool *raw)
+{
+    *raw = len && str[len - 1] == 'R';
+    if (*raw) {
+        if (quote != '"')
+            return false;
+        --len;
+    }
+    switch (len) {
+    case 0: return *raw;
+    case 1: return str[0] == 'L' || str[0] == 'u' || str[0] == 'U';
+    case 2: return str[0] == 'u' && str[1] == '8';
+    }
+    return false;
+}
+
+List<Token> Token::tokenize(uint32_t fileId, const char *data, uint32_t size)
+{
+    static const char *const punctuation[] = {
+                "<<=", ">>=", "->*", "...", "<=>",
+                "::", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "+=", "-=",
+                "*=", "/=", "%=", "&=", "|=", "^=", ".*", "##", nullptr
+    };
+
+    List<Token> ret;
+    uint32_t pos = 0, line = 1, col = 1;
+    auto advance = [&](uint32_t to) {
+        while (pos < to) {
+            if (data[pos++] == '\n') {
+                ++line;
+                col = 1;
+            } else {
+                ++col;
+            }
+        }
+    };
+    auto quoted = [data, size](uint32_t i) {
+        const char quote = data[i++];
+        while (i < size && data[i] != quote && data[i] != '\n') {
+            if (data[i] == '\\' && i + 1 < size)
+                ++i;
+            ++i;
+        }
+        return i < size && data[i] == quote ? i + 1 : i;
+    };
+    auto rawString = [data, size](uint32_t i) {
+        // R"delim( ... )delim"
+        const uint32_t delimStart = i + 1;
+        uint32_t paren = delimStart;
+        while (paren < size && data[paren] != '(' && data[paren] != '"' && data[paren] != '\n')
+            ++paren;
+        if (paren == size || data[paren] != '(')
+            return paren;
+        String terminator = ")";
+        terminator.append(data + delimStart, paren - delimStart);
+        terminator += '"';
+        const char *end = static_cast<const char *>(memmem(data + paren, size - paren, terminator.constData(), terminator.size()));
+        return end ? static_cast<uint32_t>(end - data) + static_cast<uint32_t>(terminator.size()) : size;
+    };
+
+    while (pos < size) {
+        const char ch = data[pos];
+        const char next = pos + 1 < size ? data[pos + 1] : '\0';
+        if (isspace(static_cast<unsigned char>(ch))) {
+            advance(pos + 1);
+            continue;
+        } else if (ch == '\\' && (next == '\n' || next == '\r')) {
+            advance(pos + 2);
+            continue;
+        }
+
+        CXTokenKind kind = CXToken_Punctuation;
+        uint32_t end = pos + 1;
+        if (ch == '/' && next == '/') {
+            kind = CXToken_Comment;
+            while (end < size && data[end] != '\n') {
+                if (data[end] == '\\' && end + 1 < size && data[end + 1] == '\n') {
+                    ++end;
+                } else if (data[end] == '\\' && end + 2 < size && data[end + 1] == '\r' && data[end + 2] == '\n') {
+                    end += 2;
+                }
+                ++end;
+            }
+            if (end > pos && data[end - 1] == '\r')
+                --end;
+        } else if (ch == '/' && next == '*') {
+            kind = CXToken_Comment;
+            const char *close = static_cast<const char *>(memmem(data + pos + 2, size - pos - 2, "*/", 2));
+            end = close ? static_cast<uint32_t>(close - data) + 2 : size;
+        } else if (isIdentifierStart(ch)) {
+            while (end < size && isIdentifierChar(data[end]))
+                ++end;
+            bool raw;
+            if (end < size && (data[end] == '"' || data[end] == '\'') && isLiteralPrefix(data + pos, end - pos, data[end], &raw)) {
+                kind = CXToken_Literal;
+                end = raw ? rawString(end) : quoted(end);
+            } else {
+                kind = isKeyword(String(data + pos, end - pos)) ? CXToken_Keyword : CXToken_Identifier;
+            }
+        } else if (isdigit(static_cast<unsigned char>(ch)) || (ch == '.' && isdigit(static_cast<unsigned char>(next)))) {
+            // pp-number
+            kind = CXToken_Literal;
+            while (end < size) {
+                const char c = data[end];
+                if ((c == '+' || c == '-') && strchr("eEpP", data[end - 1])) {
+                    ++end;
+                } else if (c == '\'' && end + 1 < size && isalnum(static_cast<unsigned char>(data[end + 1]))) {
+                    end += 2;
+                } else if (isIdentifierChar(c) || c == '.') {
+                    ++end;
+                } else {
+                    break;
+                }
+            }
+        } else if (ch == '"' || ch == '\'') {
+            kind = CXToken_Literal;
+            end = quoted(pos);
+        } else {
+            for (const char *const *p = punctuation; *p; ++p) {
+                const uint32_t len = strlen(*p);
+                if (pos + len <= size && !strncmp(data + pos, *p, len)) {
+                    end = pos + len;
+                    break;
+                }
+            }
+        }
+        if (kind == CXToken_Literal) {
+            // user-defined literal suffix
+            while (end < size && isIdentifierChar(data[end]))
+                ++end;
+        }
+
+        ret.push_back({ kind, String(data + pos, end - pos), Location(fileId, line, col), pos, end - pos });
+        advance(end);
+    }
+    return ret;
+}
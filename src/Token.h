@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include "rct/Serializer.h"
+#include "rct/List.h"
 #include "rct/Log.h"
 #include "Location.h"
 #include "rct/String.h"
@@ -32,6 +33,11 @@ struct Token
     uint32_t offset, length;
 
     String toString() const;
+
+    // Lexes a whole file without a translation unit, sorted by offset. Macros
+    // aren't expanded and preprocessor directives come out as plain tokens,
+    // which is what clang_tokenize gives us too.
+    static List<Token> tokenize(uint32_t fileId, const char *data, uint32_t size);
 };
 
 template <> inline Serializer &operator<<(Serializer &s, const Token &t)
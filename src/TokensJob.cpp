@@ -15,13 +15,13 @@
 
 #include "TokensJob.h"
 
+#include <algorithm>
 #include <functional>
 
 #include "Project.h"
 #include "QueryMessage.h"
 #include "rct/Log.h"
 #include "RTags.h"
-#include "FileMap.h"
 #include "Symbol.h"
 #include "Token.h"
 #include "rct/Flags.h"
@@ -41,16 +41,19 @@ int TokensJob::execute()
     std::shared_ptr<Project> proj = projects().value(0);
     if (!proj)
         return 1;
-    auto map = proj->openTokens(mFileId);
-    if (!map)
+    const String unsaved = queryMessage()->unsavedFiles().value(Location::path(mFileId));
+    const std::shared_ptr<const List<Token>> tokens = proj->tokens(mFileId, unsaved);
+    if (!tokens)
         return 2;
 
-    const uint32_t count = map->count();
-    uint32_t i = 0;
+    const size_t count = tokens->size();
+    size_t i = 0;
     if (mFrom != 0) {
-        i = map->lowerBound(mFrom);
+        i = std::lower_bound(tokens->begin(), tokens->end(), mFrom, [](const Token &token, uint32_t offset) {
+                return token.offset < offset;
+            }) - tokens->begin();
         if (i > 0 && i < count) {
-            const Token val = map->valueAt(i - 1);
+            const Token &val = tokens->at(i - 1);
             if (val.offset + val.length >= mFrom)
                 --i;
         }
@@ -92,7 +95,7 @@ int TokensJob::execute()
     }
 
     while (i < count) {
-        const Token token = map->valueAt(i++);
+        const Token &token = tokens->at(i++);
         if (token.offset > mTo)
             break;
         if (!writeToken(token))
@@ -106,6 +106,9 @@ enum {
     DEFAULT_RP_CONNECT_TIMEOUT = 0, // won't time out
     DEFAULT_RP_CONNECT_ATTEMPTS = 3,
     DEFAULT_COMPLETION_CACHE_SIZE = 10,
+    DEFAULT_COMPLETION_CACHE_MEMORY = 2048, // mb
+    DEFAULT_COMPLETION_WORKER_COUNT = 2,
+    DEFAULT_QUERY_CACHE_SIZE = 64,
     DEFAULT_ERROR_LIMIT = 50,
     DEFAULT_MAX_INCLUDE_COMPLETION_DEPTH = 3,
     DEFAULT_MAX_CRASH_COUNT = 5
@@ -191,6 +194,9 @@ enum OptionType {
     MaxCrashCount,
     MaxSocketWriteBufferSize,
     CompletionCacheSize,
+    CompletionCacheMemory,
+    CompletionWorkerCount,
+    QueryCacheSize,
     CompletionDiagnostics,
     CompletionNoFilter,
     CompletionLogs,
@@ -210,6 +216,9 @@ enum OptionType {
     NoFileManager,
     NoFileLock,
     PchEnabled,
+    AutoPch,
+    IndexerProfile,
+    AdaptiveJobCount,
     NoFilesystemWatcher,
     ArgTransform,
     NoComments,
@@ -276,6 +285,9 @@ int main(int argc, char** argv)
     serverOpts.options = Server::Wall|Server::SpellChecking|Server::CompletionDiagnostics|Server::EnableCompilerManager;
     serverOpts.maxCrashCount = DEFAULT_MAX_CRASH_COUNT;
     serverOpts.completionCacheSize = DEFAULT_COMPLETION_CACHE_SIZE;
+    serverOpts.completionCacheMemory = DEFAULT_COMPLETION_CACHE_MEMORY;
+    serverOpts.completionWorkerCount = DEFAULT_COMPLETION_WORKER_COUNT;
+    serverOpts.queryCacheSize = DEFAULT_QUERY_CACHE_SIZE;
     serverOpts.maxIncludeCompletionDepth = DEFAULT_MAX_INCLUDE_COMPLETION_DEPTH;
     serverOpts.rp = defaultRP();
     serverOpts.blockedArguments = String::split(DEFAULT_BLOCKED_ARGUMENTS, ';').toSet();
@@ -351,6 +363,9 @@ int main(int argc, char** argv)
         { MaxCrashCount, "max-crash-count", 'K', CommandLineParser::Required, String::format("Max number of crashes before giving up a sourcefile (default %d).", DEFAULT_MAX_CRASH_COUNT) },
         { MaxSocketWriteBufferSize, "max-socket-write-buffer-size", 0, CommandLineParser::Required, "Max number of bytes buffered after EAGAIN." },
         { CompletionCacheSize, "completion-cache-size", 'i', CommandLineParser::Required, String::format("Number of translation units to cache (default %d).", DEFAULT_COMPLETION_CACHE_SIZE) },
+        { CompletionCacheMemory, "completion-cache-memory", 0, CommandLineParser::Required, String::format("Megabytes of memory cached translation units may use before the least recently used large ones are dropped, 0 for no limit (default %d).", DEFAULT_COMPLETION_CACHE_MEMORY) },
+        { CompletionWorkerCount, "completion-workers", 0, CommandLineParser::Required, String::format("Number of threads to run completions on. Each cached translation unit stays on one of them (default %d).", DEFAULT_COMPLETION_WORKER_COUNT) },
+        { QueryCacheSize, "query-cache-size", 0, CommandLineParser::Required, String::format("Number of symbol info, follow location and references results to cache, 0 disables the cache (default %d).", DEFAULT_QUERY_CACHE_SIZE) },
         { CompletionNoFilter, "completion-no-filter", 0, CommandLineParser::NoValue, "Don't filter private members and destructors from completions." },
         { CompletionLogs, "completion-logs", 0, CommandLineParser::NoValue, "Log more info about completions." },
         { CompletionDiagnostics, "completion-diagnostics", 0, CommandLineParser::Optional, "Send diagnostics from completion thread." },
@@ -371,6 +386,9 @@ int main(int argc, char** argv)
         { NoFileManager, "no-filemanager", 0, CommandLineParser::NoValue, "Don't scan project directory for files. (rc -P won't work)." },
         { NoFileLock, "no-file-lock", 0, CommandLineParser::NoValue, "Disable file locking. Not entirely safe but might improve performance on certain systems." },
         { PchEnabled, "pch-enabled", 0, CommandLineParser::NoValue, "Enable PCH (experimental)." },
+        { AutoPch, "auto-pch", 0, CommandLineParser::NoValue, "Build shared PCHs for the leading includes common to many sources and index with them (experimental, implies --pch-enabled)." },
+        { IndexerProfile, "indexer-profile", 0, CommandLineParser::NoValue, "Have rp time indexVisitor per cursor kind and log the profile of each indexed file (rc --status profile)." },
+        { AdaptiveJobCount, "adaptive-job-count", 0, CommandLineParser::Required, "Run between arg and --job-count concurrent indexing processes depending on memory pressure and load." },
         { NoFilesystemWatcher, "no-filesystem-watcher", 'B', CommandLineParser::NoValue, "Disable file system watching altogether. Reindexing has to be triggered manually." },
         { ArgTransform, "arg-transform", 'V', CommandLineParser::Required, "Use arg to transform arguments. [arg] should be executable with (execv(3))." },
         { NoComments, "no-comments", 0, CommandLineParser::NoValue, "Don't parse/store doxygen comments." },
@@ -617,6 +635,24 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid argument to -i %s", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case CompletionCacheMemory: {
+            serverOpts.completionCacheMemory = atoi(value.constData());
+            if (serverOpts.completionCacheMemory < 0) {
+                return { String::format<1024>("Invalid argument to --completion-cache-memory %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case CompletionWorkerCount: {
+            serverOpts.completionWorkerCount = atoi(value.constData());
+            if (serverOpts.completionWorkerCount <= 0) {
+                return { String::format<1024>("Invalid argument to --completion-workers %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case QueryCacheSize: {
+            serverOpts.queryCacheSize = atoi(value.constData());
+            if (serverOpts.queryCacheSize < 0) {
+                return { String::format<1024>("Invalid argument to --query-cache-size %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case CompletionDiagnostics: {
             if (value == "off" || value == "false" || value == "0") {
                 serverOpts.options &= ~Server::CompletionDiagnostics;
@@ -675,6 +711,20 @@ int main(int argc, char** argv)
         case PchEnabled: {
             serverOpts.options |= Server::PCHEnabled;
             break; }
+        case AutoPch: {
+            serverOpts.options |= Server::PCHEnabled|Server::AutoPCH;
+            break; }
+        case IndexerProfile: {
+            serverOpts.options |= Server::IndexerProfile;
+            break; }
+        case AdaptiveJobCount: {
+            bool ok;
+            serverOpts.minJobCount = String(value).toULong(&ok);
+            if (!ok || !serverOpts.minJobCount) {
+                return { String::format<1024>("Can't parse argument to --adaptive-job-count %s. Must be a positive integer.\n", value.constData()), CommandLineParser::Parse_Error };
+            }
+            serverOpts.options |= Server::AdaptiveJobCount;
+            break; }
         case NoFilesystemWatcher: {
             serverOpts.options |= Server::NoFileSystemWatch;
             break; }
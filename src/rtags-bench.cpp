@@ -0,0 +1,436 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+// rtags-bench generates synthetic projects and replays query logs against a
+// running rdm. A query log has one rc command line per line, e.g.:
+//
+//   --follow-location /tmp/bench/src/tu0.cpp:5:20:
+//   --references /tmp/bench/include/header0.h:5:9: --all-references
+//
+// Every query is run with RClient like rc would run it and the latency is
+// reported per query type. With --rdm-pid the read/write syscalls and minor
+// page faults rdm needed for each query are reported as well.
+//
+// With --index the project in a directory is loaded and reindexed repeatedly
+// to measure indexing throughput. Run rdm with --indexer-profile to get the
+// per cursor kind breakdown in the profile printed at the end.
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include "CommandLineParser.h"
+#include "RClient.h"
+#include "rct/List.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+enum OptionType {
+    None = 0,
+    Help,
+    Generate,
+    TranslationUnits,
+    Headers,
+    FanOut,
+    Replay,
+    Iterations,
+    RdmPid,
+    SocketFile,
+    Index,
+    Jobs
+};
+
+struct ProcStats {
+    uint64_t syscalls { 0 };
+    uint64_t minorFaults { 0 };
+};
+
+static bool readProcStats(pid_t pid, ProcStats &stats)
+{
+    const String io = Path(String::format<64>("/proc/%d/io", pid)).readAll();
+    const String stat = Path(String::format<64>("/proc/%d/stat", pid)).readAll();
+    if (io.empty() || stat.empty())
+        return false;
+    stats = ProcStats();
+    for (const String &line : io.split('\n')) {
+        if (line.startsWith("syscr: ") || line.startsWith("syscw: "))
+            stats.syscalls += strtoull(line.constData() + 7, nullptr, 10);
+    }
+    // the fields after the command name, minflt is the 10th field of the file
+    const size_t paren = stat.lastIndexOf(')');
+    if (paren == String::npos)
+        return false;
+    const List<String> fields = stat.mid(paren + 2).split(' ');
+    if (fields.size() <= 7)
+        return false;
+    stats.minorFaults = strtoull(fields.at(7).constData(), nullptr, 10);
+    return true;
+}
+
+static bool writeFile(const Path &path, const String &contents)
+{
+    FILE *f = fopen(path.constData(), "w");
+    if (!f) {
+        fprintf(stderr, "Can't open %s for writing\n", path.constData());
+        return false;
+    }
+    const bool ok = fwrite(contents.constData(), 1, contents.size(), f) == contents.size();
+    fclose(f);
+    return ok;
+}
+
+// Every header declares a class with a few methods and a function, every
+// translation unit includes fanOut headers and calls into them. queries.txt
+// gets a follow-location, references, symbol-info and find-symbols query per
+// header.
+static bool generate(Path dir, int tuCount, int headerCount, int fanOut)
+{
+    dir.resolve(Path::MakeAbsolute);
+    if (!dir.endsWith('/'))
+        dir += '/';
+    const Path includeDir = dir + "include/";
+    const Path srcDir = dir + "src/";
+    Path::mkdir(includeDir, Path::Recursive);
+    Path::mkdir(srcDir, Path::Recursive);
+    fanOut = std::min(fanOut, headerCount);
+
+    enum { MethodCount = 4 };
+    String queries;
+    for (int h=0; h<headerCount; ++h) {
+        const Path header = String::format<1024>("%sheader%d.h", includeDir.constData(), h);
+        String contents = String::format<128>("#ifndef HEADER%d_H\n#define HEADER%d_H\nnamespace bench {\nstruct Class%d {\n", h, h, h);
+        for (int m=0; m<MethodCount; ++m)
+            contents += String::format<128>("    int method%d(int value) const { return value + %d; }\n", m, m);
+        contents += String::format<128>("};\nint function%d(int value);\n}\n#endif\n", h);
+        if (!writeFile(header, contents))
+            return false;
+        // "    int method0(" is on line 5
+        queries += String::format<1024>("--references %s:5:9: --all-references\n", header.constData());
+        queries += String::format<1024>("--find-symbols bench::Class%d\n", h);
+    }
+
+    String compileCommands = "[\n";
+    for (int t=0; t<tuCount; ++t) {
+        const Path source = String::format<1024>("%stu%d.cpp", srcDir.constData(), t);
+        String contents;
+        int line = 1;
+        for (int k=0; k<fanOut; ++k) {
+            contents += String::format<64>("#include \"header%d.h\"\n", (t + k) % headerCount);
+            ++line;
+        }
+        if (t < headerCount) {
+            contents += String::format<128>("int bench::function%d(int value) { return value * 2; }\n", t);
+            ++line;
+        }
+        contents += String::format<64>("int tu%d(int value)\n{\n", t);
+        line += 2;
+        for (int k=0; k<fanOut; ++k) {
+            const int h = (t + k) % headerCount;
+            contents += String::format<128>("    bench::Class%d object%d;\n", h, k);
+            if (k == 0)
+                queries += String::format<1024>("--symbol-info %s:%d:%d:\n", source.constData(), line, 12);
+            ++line;
+            for (int m=0; m<MethodCount; ++m) {
+                const String call = String::format<128>("    value += object%d.method%d(value);\n", k, m);
+                if (k == 0 && m == 0)
+                    queries += String::format<1024>("--follow-location %s:%d:%zu:\n", source.constData(), line, call.indexOf("method") + 1);
+                contents += call;
+                ++line;
+            }
+            contents += String::format<128>("    value += bench::function%d(value);\n", h);
+            ++line;
+        }
+        contents += "    return value;\n}\n";
+        if (!writeFile(source, contents))
+            return false;
+        compileCommands += String::format<4096>("%s  { \"directory\": \"%s\", \"command\": \"c++ -std=c++11 -I%s -c %s\", \"file\": \"%s\" }",
+                                                t ? ",\n" : "", dir.constData(), includeDir.constData(),
+                                                source.constData(), source.constData());
+    }
+    compileCommands += "\n]\n";
+    if (!writeFile(dir + "compile_commands.json", compileCommands) || !writeFile(dir + "queries.txt", queries))
+        return false;
+    printf("Generated %d translation units and %d headers in %s\n"
+           "Index with: rc -J %s (or time it with rtags-bench --index %s)\n"
+           "Then run: rtags-bench --replay %squeries.txt\n",
+           tuCount, headerCount, dir.constData(), dir.constData(), dir.constData(), dir.constData());
+    return true;
+}
+
+struct Sample {
+    double ms;
+    ProcStats stats;
+};
+
+static int runRc(List<String> args, const String &socketFile, bool silent = true)
+{
+    args.insert(args.begin(), "rc");
+    if (silent)
+        args.insert(args.begin() + 1, "--silent");
+    if (!socketFile.empty()) {
+        args.push_back("--socket-file");
+        args.push_back(socketFile);
+    }
+    std::vector<char *> argv;
+    for (String &arg : args)
+        argv.push_back(arg.data());
+
+    RClient rc;
+    if (rc.parse(argv.size(), argv.data()).status != CommandLineParser::Parse_Exec) {
+        fprintf(stderr, "Can't parse rc command: %s\n", String::join(args, ' ').constData());
+        return -1;
+    }
+    rc.exec();
+    return rc.exitCode();
+}
+
+static int indexProject(Path dir, int iterations, int jobs, const String &socketFile)
+{
+    dir.resolve();
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    const String compileCommands = Path(dir + "compile_commands.json").readAll();
+    size_t files = 0;
+    for (size_t idx = compileCommands.indexOf("\"file\""); idx != String::npos; idx = compileCommands.indexOf("\"file\"", idx + 1))
+        ++files;
+    if (!files) {
+        fprintf(stderr, "No sources in %scompile_commands.json\n", dir.constData());
+        return 1;
+    }
+
+    if (jobs && runRc({ "--job-count", String::number(jobs) }, socketFile) != RTags::Success)
+        return 1;
+    if (runRc({ "--load-compile-commands", dir }, socketFile) != RTags::Success)
+        return 1;
+
+    // The first round also waits for the initial load to be indexed and isn't
+    // counted.
+    List<double> rounds;
+    for (int i=0; i<=iterations; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        if (runRc({ "--reindex", "--wait" }, socketFile) != RTags::Success) {
+            fprintf(stderr, "Reindexing %s failed\n", dir.constData());
+            return 1;
+        }
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i) {
+            rounds.push_back(secs);
+            printf("round %d: %zu files in %.2fs, %.1f files/sec\n", i, files, secs, files / secs);
+        }
+    }
+    std::sort(rounds.begin(), rounds.end());
+    const double median = rounds.at(rounds.size() / 2);
+    printf("median: %.2fs, %.1f files/sec\n\n", median, files / median);
+    return runRc({ "--status", "profile" }, socketFile, false) == RTags::Success ? 0 : 1;
+}
+
+static double percentile(const List<Sample> &sorted, double p)
+{
+    const size_t idx = std::min<size_t>(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted.at(idx).ms;
+}
+
+static int replay(const Path &log, int iterations, pid_t rdmPid, const String &socketFile)
+{
+    const String contents = log.readAll();
+    if (contents.empty()) {
+        fprintf(stderr, "Can't read queries from %s\n", log.constData());
+        return 1;
+    }
+    List<List<String>> queries;
+    for (const String &line : contents.split('\n')) {
+        if (line.empty() || line.startsWith('#'))
+            continue;
+        List<String> args;
+        for (String &arg : line.split(' ')) {
+            if (!arg.empty())
+                args.push_back(std::move(arg));
+        }
+        if (!args.empty())
+            queries.push_back(std::move(args));
+    }
+
+    Map<String, List<Sample>> samples;
+    int failures = 0;
+    for (int i=0; i<iterations; ++i) {
+        for (const List<String> &query : queries) {
+            List<String> args;
+            args << "rc" << "--silent";
+            if (!socketFile.empty())
+                args << "--socket-file" << socketFile;
+            args += query;
+            std::vector<char *> argv;
+            for (String &arg : args)
+                argv.push_back(arg.data());
+
+            RClient rc;
+            if (rc.parse(argv.size(), argv.data()).status != CommandLineParser::Parse_Exec) {
+                fprintf(stderr, "Can't parse query: %s\n", String::join(query, ' ').constData());
+                return 1;
+            }
+            Sample sample;
+            ProcStats before, after;
+            const bool stats = rdmPid && readProcStats(rdmPid, before);
+            const auto start = std::chrono::steady_clock::now();
+            rc.exec();
+            sample.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (stats && readProcStats(rdmPid, after)) {
+                sample.stats.syscalls = after.syscalls - before.syscalls;
+                sample.stats.minorFaults = after.minorFaults - before.minorFaults;
+            }
+            if (rc.exitCode() != RTags::Success && rc.exitCode() != RTags::GeneralFailure)
+                ++failures;
+            const String &type = query.front();
+            const size_t eq = type.indexOf('=');
+            samples[eq == String::npos ? type : type.left(eq)].push_back(sample);
+        }
+    }
+
+    printf("%-24s %8s %10s %10s %10s", "query", "count", "p50 ms", "p99 ms", "max ms");
+    if (rdmPid)
+        printf(" %10s %10s", "syscalls", "minflt");
+    printf("\n");
+    for (auto &it : samples) {
+        List<Sample> &list = it.second;
+        std::sort(list.begin(), list.end(), [](const Sample &a, const Sample &b) { return a.ms < b.ms; });
+        printf("%-24s %8zu %10.3f %10.3f %10.3f", it.first.constData(), list.size(),
+               percentile(list, 0.5), percentile(list, 0.99), list.back().ms);
+        if (rdmPid) {
+            uint64_t syscalls = 0, minorFaults = 0;
+            for (const Sample &sample : list) {
+                syscalls += sample.stats.syscalls;
+                minorFaults += sample.stats.minorFaults;
+            }
+            printf(" %10.1f %10.1f", static_cast<double>(syscalls) / list.size(),
+                   static_cast<double>(minorFaults) / list.size());
+        }
+        printf("\n");
+    }
+    if (failures)
+        printf("%d queries failed\n", failures);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const std::initializer_list<CommandLineParser::Option<OptionType>> opts = {
+        { None, String(), 0, CommandLineParser::NoValue, "Options:" },
+        { Help, "help", 'h', CommandLineParser::NoValue, "Display this page." },
+        { Generate, "generate", 'g', CommandLineParser::Required, "Generate a synthetic project in this directory." },
+        { TranslationUnits, "translation-units", 't', CommandLineParser::Required, "Number of translation units for --generate (default 100)." },
+        { Headers, "headers", 'H', CommandLineParser::Required, "Number of headers for --generate (default 20)." },
+        { FanOut, "fan-out", 'f', CommandLineParser::Required, "Headers included and used by every translation unit for --generate (default 5)." },
+        { Replay, "replay", 'r', CommandLineParser::Required, "Replay the rc command lines in this file against rdm." },
+        { Iterations, "iterations", 'i', CommandLineParser::Required, "Number of times to replay the queries (default 10)." },
+        { RdmPid, "rdm-pid", 'p', CommandLineParser::Required, "Report syscalls and minor page faults of this rdm process per query." },
+        { SocketFile, "socket-file", 'n', CommandLineParser::Required, "Use this socket file to connect to rdm." },
+        { Index, "index", 'x', CommandLineParser::Required, "Load the compile_commands.json in this directory and time reindexing it." },
+        { Jobs, "jobs", 'j', CommandLineParser::Required, "Job count to set in rdm for --index." },
+        { None, String(), 0, CommandLineParser::NoValue, nullptr }
+    };
+
+    Path generateDir, replayLog, indexDir;
+    String socketFile;
+    int tuCount = 100, headerCount = 20, fanOut = 5, iterations = 10, jobs = 0;
+    pid_t rdmPid = 0;
+    std::function<CommandLineParser::ParseStatus(OptionType, String &&, size_t &, const List<String> &)> cb;
+    cb = [&](OptionType type, String &&value, size_t &, const List<String> &) -> CommandLineParser::ParseStatus {
+        auto number = [&value](int &out, const char *name) -> bool {
+            out = atoi(value.constData());
+            if (out <= 0) {
+                fprintf(stderr, "Invalid --%s %s\n", name, value.constData());
+                return false;
+            }
+            return true;
+        };
+        switch (type) {
+        case None:
+            assert(0);
+            break;
+        case Help:
+            CommandLineParser::help(stdout, "rtags-bench", opts);
+            return { String(), CommandLineParser::Parse_Ok };
+        case Generate:
+            generateDir = std::move(value);
+            break;
+        case TranslationUnits:
+            if (!number(tuCount, "translation-units"))
+                return { String(), CommandLineParser::Parse_Error };
+            break;
+        case Headers:
+            if (!number(headerCount, "headers"))
+                return { String(), CommandLineParser::Parse_Error };
+            break;
+        case FanOut:
+            if (!number(fanOut, "fan-out"))
+                return { String(), CommandLineParser::Parse_Error };
+            break;
+        case Replay:
+            replayLog = std::move(value);
+            break;
+        case Iterations:
+            if (!number(iterations, "iterations"))
+                return { String(), CommandLineParser::Parse_Error };
+            break;
+        case RdmPid: {
+            int pid;
+            if (!number(pid, "rdm-pid"))
+                return { String(), CommandLineParser::Parse_Error };
+            rdmPid = pid;
+            break; }
+        case SocketFile:
+            socketFile = std::move(value);
+            break;
+        case Index:
+            indexDir = std::move(value);
+            break;
+        case Jobs:
+            if (!number(jobs, "jobs"))
+                return { String(), CommandLineParser::Parse_Error };
+            break;
+        }
+        return { String(), CommandLineParser::Parse_Exec };
+    };
+
+    const CommandLineParser::ParseStatus status = CommandLineParser::parse<OptionType>(argc, argv, opts, NullFlags, cb);
+    switch (status.status) {
+    case CommandLineParser::Parse_Error:
+        if (!status.error.empty())
+            fprintf(stderr, "%s\n", status.error.constData());
+        return 1;
+    case CommandLineParser::Parse_Ok:
+        return 0;
+    case CommandLineParser::Parse_Exec:
+        break;
+    }
+
+    if (generateDir.empty() + replayLog.empty() + indexDir.empty() != 2) {
+        fprintf(stderr, "Pass one of --generate, --replay and --index\n");
+        return 1;
+    }
+    if (!generateDir.empty())
+        return generate(generateDir, tuCount, headerCount, fanOut) ? 0 : 1;
+    if (!indexDir.empty())
+        return indexProject(indexDir, iterations, jobs, socketFile);
+    return replay(replayLog, iterations, rdmPid, socketFile);
+}
@@ -0,0 +1,157 @@
+import os
+import os.path
+import re
+import shutil
+
+import pytest
+from _pytest.tmpdir import TempPathFactory
+
+from . import utils
+
+TOKEN_RE = re.compile(
+    r'Location:\s*(?P<path>.+?):(?P<line>\d+):(?P<column>\d+):\s+'
+    r'Offset:\s*(?P<offset>\d+)\s+Length:\s*(?P<length>\d+)\s+Kind:\s*(?P<kind>\w+)'
+)
+
+# CXTokenKind
+KINDS = {'0': 'Punctuation', '1': 'Keyword', '2': 'Identifier', '3': 'Literal', '4': 'Comment'}
+
+# What clang_tokenize returns for tokens.cpp: line, column, kind and spelling
+EXPECTED = [
+    (1, 1, 'Comment', '// line comment \\\ncontinued'),
+    (3, 1, 'Keyword', 'int'),
+    (3, 5, 'Keyword', 'operator'),
+    (3, 13, 'Literal', '""_km'),
+    (3, 18, 'Punctuation', '('),
+    (3, 19, 'Keyword', 'unsigned'),
+    (3, 28, 'Keyword', 'long'),
+    (3, 33, 'Keyword', 'long'),
+    (3, 38, 'Identifier', 'v'),
+    (3, 39, 'Punctuation', ')'),
+    (3, 41, 'Punctuation', '{'),
+    (3, 43, 'Keyword', 'return'),
+    (3, 50, 'Identifier', 'v'),
+    (3, 51, 'Punctuation', ';'),
+    (3, 53, 'Punctuation', '}'),
+    (4, 1, 'Keyword', 'const'),
+    (4, 7, 'Keyword', 'char'),
+    (4, 12, 'Punctuation', '*'),
+    (4, 13, 'Keyword', 'operator'),
+    (4, 21, 'Literal', '""_s'),
+    (4, 25, 'Punctuation', '('),
+    (4, 26, 'Keyword', 'const'),
+    (4, 32, 'Keyword', 'char'),
+    (4, 37, 'Punctuation', '*'),
+    (4, 38, 'Identifier', 's'),
+    (4, 39, 'Punctuation', ','),
+    (4, 41, 'Keyword', 'decltype'),
+    (4, 49, 'Punctuation', '('),
+    (4, 50, 'Keyword', 'sizeof'),
+    (4, 56, 'Punctuation', '('),
+    (4, 57, 'Literal', '0'),
+    (4, 58, 'Punctuation', ')'),
+    (4, 59, 'Punctuation', ')'),
+    (4, 60, 'Punctuation', ')'),
+    (4, 62, 'Punctuation', '{'),
+    (4, 64, 'Keyword', 'return'),
+    (4, 71, 'Identifier', 's'),
+    (4, 72, 'Punctuation', ';'),
+    (4, 74, 'Punctuation', '}'),
+    (5, 1, 'Keyword', 'auto'),
+    (5, 6, 'Identifier', 'a'),
+    (5, 8, 'Punctuation', '='),
+    (5, 10, 'Literal', 'R"x(raw "string" )" here)x"'),
+    (5, 37, 'Punctuation', ';'),
+    (6, 1, 'Keyword', 'auto'),
+    (6, 6, 'Identifier', 'b'),
+    (6, 8, 'Punctuation', '='),
+    (6, 10, 'Literal', "1'000'000"),
+    (6, 19, 'Punctuation', ';'),
+    (7, 1, 'Keyword', 'auto'),
+    (7, 6, 'Identifier', 'c'),
+    (7, 8, 'Punctuation', '='),
+    (7, 10, 'Literal', '12_km'),
+    (7, 15, 'Punctuation', ';'),
+    (8, 1, 'Keyword', 'auto'),
+    (8, 6, 'Identifier', 'd'),
+    (8, 8, 'Punctuation', '='),
+    (8, 10, 'Literal', 'u8"text"_s'),
+    (8, 20, 'Punctuation', ';'),
+    (9, 1, 'Keyword', 'auto'),
+    (9, 6, 'Identifier', 'e'),
+    (9, 8, 'Punctuation', '='),
+    (9, 10, 'Literal', '0x1p-3'),
+    (9, 16, 'Punctuation', ';'),
+    (10, 1, 'Comment', '/* block\n   comment */'),
+    (11, 15, 'Keyword', 'int'),
+    (11, 19, 'Identifier', 'f'),
+    (11, 20, 'Punctuation', ';'),
+    (12, 1, 'Punctuation', '#'),
+    (12, 2, 'Identifier', 'define'),
+    (12, 9, 'Identifier', 'M'),
+    (12, 10, 'Punctuation', '('),
+    (12, 11, 'Identifier', 'x'),
+    (12, 12, 'Punctuation', ')'),
+    (12, 14, 'Identifier', 'x'),
+    (12, 16, 'Punctuation', '##'),
+    (12, 19, 'Identifier', '_y'),
+]
+
+
+@pytest.fixture(scope='module')
+def directory(tmp_path_factory: TempPathFactory):
+    '''Copy the fixture and add a CRLF variant of it.'''
+    tmp_directory = str(tmp_path_factory.mktemp('tokens_test'))
+    src = os.path.join(os.path.dirname(__file__), 'tokens_test', 'tokens.cpp')
+    shutil.copy(src, tmp_directory)
+    with open(src, 'rb') as f:
+        data = f.read()
+    with open(os.path.join(tmp_directory, 'tokens_crlf.cpp'), 'wb') as f:
+        f.write(data.replace(b'\n', b'\r\n'))
+    yield tmp_directory
+
+
+@pytest.fixture(scope='module')
+def rtags(directory: str):
+    _rtags = utils.RTags(directory)
+    _rtags.rdm()
+    _rtags.parse(
+        directory, ['tokens.cpp', 'tokens_crlf.cpp'],
+        compile_commands=['clang++ -std=c++14 -c tokens.cpp', 'clang++ -std=c++14 -c tokens_crlf.cpp']
+    )
+    yield _rtags
+    _rtags.rdm_stop()
+
+
+def tokens(rtags: utils.RTags, path: str):
+    '''Return line, column, kind and spelling of every token rc --tokens reports for path.'''
+    with open(path, 'rb') as f:
+        data = f.read()
+    ret = []
+    for match in TOKEN_RE.finditer(rtags.rc('--tokens', path)):
+        offset = int(match.group('offset'))
+        length = int(match.group('length'))
+        line = int(match.group('line'))
+        column = int(match.group('column'))
+        # the location has to agree with the offset
+        assert line == data.count(b'\n', 0, offset) + 1
+        assert column == offset - (data.rfind(b'\n', 0, offset) + 1) + 1
+        spelling = data[offset:offset + length].decode().replace('\r\n', '\n')
+        ret.append((line, column, KINDS.get(match.group('kind'), match.group('kind')), spelling))
+    return ret
+
+
+# pylint: disable=redefined-outer-name
+@pytest.mark.parametrize('name', ['tokens.cpp', 'tokens_crlf.cpp'])
+def test_tokens(name: str, directory: str, rtags: utils.RTags):
+    assert tokens(rtags, os.path.join(directory, name)) == EXPECTED
+
+
+def test_tokens_range(directory: str, rtags: utils.RTags):
+    # only the tokens of line 6, "auto b = 1'000'000;"
+    path = os.path.join(directory, 'tokens.cpp')
+    with open(path, 'rb') as f:
+        data = f.read()
+    start = data.index(b'auto b')
+    end = data.index(b';', start)
+    assert tokens(rtags, '{}:{}-{}'.format(path, start, end)) == [t for t in EXPECTED if t[0] == 6]
@@ -0,0 +1,12 @@
+// line comment \
+continued
+int operator""_km(unsigned long long v) { return v; }
+const char *operator""_s(const char *s, decltype(sizeof(0))) { return s; }
+auto a = R"x(raw "string" )" here)x";
+auto b = 1'000'000;
+auto c = 12_km;
+auto d = u8"text"_s;
+auto e = 0x1p-3;
+/* block
+   comment */ int f;
+#define M(x) x ## _y